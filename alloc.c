@@ -0,0 +1,610 @@
+/*
+ * Copyright (C) 2021 Jo-Philipp Wich <jo@mein.io>
+ * Copyright (C) 2021 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ucrun.h"
+
+/*
+ * ucrun replaces the malloc family of the whole process, so every value
+ * the VM creates, as well as the allocations of libubox, libubus and libc
+ * itself, is accounted here. Requests up to 2 KiB are served from slabs of
+ * 64 KiB which each hold objects of a single size class, larger ones are
+ * mapped individually and a few of those mappings are cached for reuse
+ * once freed. Every slab and large block starts at a 64 KiB
+ * boundary with its header, which is how free() finds it.
+ *
+ * The usage is the sum of the object sizes handed out plus the length of
+ * the large mappings. It drops as soon as memory is freed, independent of
+ * whether pages were returned to the kernel, and it does not include file
+ * mappings like the state store or the metrics segment.
+ *
+ * Once a hard limit is set, requests that would exceed it fail. The VM
+ * treats a failed allocation as fatal, so the process terminates instead
+ * of growing any further.
+ *
+ * Building with UCRUN_SYSTEM_MALLOC keeps the libc allocator, the usage is
+ * then approximated by the anonymous resident memory, there are no size
+ * class statistics and no hard limit.
+ */
+
+#ifndef UCRUN_SYSTEM_MALLOC
+
+#define ALLOC_CHUNK_SIZE	(64 * 1024)
+#define ALLOC_HDR_SIZE		64
+#define ALLOC_EMPTY_MAX		4
+#define ALLOC_CACHE_MAX		16
+#define ALLOC_CACHE_SIZE	(1024 * 1024)
+#define ALLOC_LARGE		UCRUN_ALLOC_CLASSES
+
+typedef struct alloc_chunk {
+	struct alloc_chunk *prev;
+	struct alloc_chunk *next;
+	void *free;
+	size_t size;
+	uint32_t used;
+	uint32_t bump;
+	uint16_t cls;
+	uint16_t offset;
+} alloc_chunk_t;
+
+static const size_t alloc_sizes[UCRUN_ALLOC_CLASSES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+static struct {
+	alloc_chunk_t *partial[UCRUN_ALLOC_CLASSES];
+	alloc_chunk_t *empty;
+	size_t nempty;
+	alloc_chunk_t *cache;
+	size_t ncache;
+	ucrun_alloc_stats_t stats;
+	size_t pagesize;
+	char lock;
+} heap;
+
+static void
+alloc_lock(void)
+{
+	while (__atomic_test_and_set(&heap.lock, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void
+alloc_unlock(void)
+{
+	__atomic_clear(&heap.lock, __ATOMIC_RELEASE);
+}
+
+static int
+alloc_class(size_t size)
+{
+	int cls;
+
+	for (cls = 0; cls < UCRUN_ALLOC_CLASSES; cls++)
+		if (size <= alloc_sizes[cls])
+			return cls;
+
+	return ALLOC_LARGE;
+}
+
+static bool
+alloc_admit(size_t len)
+{
+	return !heap.stats.limit || heap.stats.usage + len <= heap.stats.limit;
+}
+
+static void
+alloc_account(ssize_t len)
+{
+	heap.stats.usage += len;
+
+	if (heap.stats.usage > heap.stats.peak)
+		heap.stats.peak = heap.stats.usage;
+}
+
+/* map len bytes starting at a chunk boundary */
+static void *
+alloc_map(size_t len)
+{
+	char *p, *a;
+
+	p = mmap(NULL, len + ALLOC_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED)
+		return NULL;
+
+	a = (char *)(((uintptr_t)p + ALLOC_CHUNK_SIZE - 1) & ~(uintptr_t)(ALLOC_CHUNK_SIZE - 1));
+
+	if (a > p)
+		munmap(p, a - p);
+
+	if (p + ALLOC_CHUNK_SIZE > a)
+		munmap(a + len, p + ALLOC_CHUNK_SIZE - a);
+
+	heap.stats.mapped += len;
+
+	return a;
+}
+
+static void
+alloc_unmap(void *p, size_t len)
+{
+	munmap(p, len);
+	heap.stats.mapped -= len;
+}
+
+static void
+alloc_link(alloc_chunk_t **list, alloc_chunk_t *c)
+{
+	c->prev = NULL;
+	c->next = *list;
+
+	if (*list)
+		(*list)->prev = c;
+
+	*list = c;
+}
+
+static void
+alloc_unlink(alloc_chunk_t **list, alloc_chunk_t *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		*list = c->next;
+
+	if (c->next)
+		c->next->prev = c->prev;
+}
+
+static uint32_t
+alloc_capacity(int cls)
+{
+	return (ALLOC_CHUNK_SIZE - ALLOC_HDR_SIZE) / alloc_sizes[cls];
+}
+
+static void *
+alloc_small(int cls)
+{
+	ucrun_alloc_class_t *stat = &heap.stats.classes[cls];
+	alloc_chunk_t *c = heap.partial[cls];
+	void **obj;
+
+	if (!alloc_admit(alloc_sizes[cls]))
+		return NULL;
+
+	if (!c) {
+		/* reuse a cached empty slab before mapping a new one */
+		if (heap.empty) {
+			c = heap.empty;
+			heap.empty = c->next;
+			heap.nempty--;
+		}
+		else {
+			c = alloc_map(ALLOC_CHUNK_SIZE);
+
+			if (!c)
+				return NULL;
+		}
+
+		memset(c, 0, sizeof(*c));
+		c->cls = cls;
+		c->bump = ALLOC_HDR_SIZE;
+		stat->slabs++;
+		alloc_link(&heap.partial[cls], c);
+	}
+
+	if (c->free) {
+		obj = c->free;
+		c->free = *obj;
+	}
+	else {
+		obj = (void **)((char *)c + c->bump);
+		c->bump += alloc_sizes[cls];
+	}
+
+	if (++c->used == alloc_capacity(cls))
+		alloc_unlink(&heap.partial[cls], c);
+
+	if (++stat->used > stat->peak)
+		stat->peak = stat->used;
+
+	alloc_account(alloc_sizes[cls]);
+
+	return obj;
+}
+
+static void
+alloc_small_free(alloc_chunk_t *c, void *ptr)
+{
+	ucrun_alloc_class_t *stat = &heap.stats.classes[c->cls];
+	bool full = (c->used == alloc_capacity(c->cls));
+	void **obj = ptr;
+
+	*obj = c->free;
+	c->free = obj;
+	c->used--;
+	stat->used--;
+	alloc_account(-(ssize_t)alloc_sizes[c->cls]);
+
+	if (c->used) {
+		if (full)
+			alloc_link(&heap.partial[c->cls], c);
+
+		return;
+	}
+
+	/* a slab that became empty is cached or returned to the kernel */
+	if (!full)
+		alloc_unlink(&heap.partial[c->cls], c);
+
+	stat->slabs--;
+
+	if (heap.nempty < ALLOC_EMPTY_MAX) {
+		c->next = heap.empty;
+		heap.empty = c;
+		heap.nempty++;
+	}
+	else {
+		alloc_unmap(c, ALLOC_CHUNK_SIZE);
+	}
+}
+
+/* keep a few freed mappings around, blocks of this size tend to come back */
+static void
+alloc_large_release(alloc_chunk_t *c)
+{
+	if (heap.ncache < ALLOC_CACHE_MAX && c->size <= ALLOC_CACHE_SIZE) {
+		c->next = heap.cache;
+		heap.cache = c;
+		heap.ncache++;
+	}
+	else {
+		alloc_unmap(c, c->size);
+	}
+}
+
+static void *
+alloc_large(size_t size, size_t align)
+{
+	size_t offset = (align > ALLOC_HDR_SIZE) ? align : ALLOC_HDR_SIZE;
+	alloc_chunk_t *c, **prev;
+	size_t len;
+
+	if (!heap.pagesize)
+		heap.pagesize = sysconf(_SC_PAGESIZE);
+
+	if (size > SIZE_MAX - offset - 2 * ALLOC_CHUNK_SIZE)
+		return NULL;
+
+	len = (offset + size + heap.pagesize - 1) & ~(heap.pagesize - 1);
+
+	/* prefer a cached mapping that wastes at most half of its length */
+	for (prev = &heap.cache; (c = *prev) != NULL; prev = &c->next)
+		if (c->size >= len && c->size / 2 <= len)
+			break;
+
+	if (c) {
+		*prev = c->next;
+		heap.ncache--;
+		len = c->size;
+	}
+
+	if (!alloc_admit(len)) {
+		if (c)
+			alloc_large_release(c);
+
+		return NULL;
+	}
+
+	if (!c)
+		c = alloc_map(len);
+
+	if (!c)
+		return NULL;
+
+	c->cls = ALLOC_LARGE;
+	c->offset = offset;
+	c->size = len;
+
+	heap.stats.large++;
+	heap.stats.large_bytes += len;
+	alloc_account(len);
+
+	return (char *)c + offset;
+}
+
+static alloc_chunk_t *
+alloc_chunk(void *ptr)
+{
+	return (alloc_chunk_t *)((uintptr_t)ptr & ~(uintptr_t)(ALLOC_CHUNK_SIZE - 1));
+}
+
+static size_t
+alloc_usable(void *ptr)
+{
+	alloc_chunk_t *c = alloc_chunk(ptr);
+
+	if (c->cls == ALLOC_LARGE)
+		return c->size - c->offset;
+
+	return alloc_sizes[c->cls];
+}
+
+static void *
+alloc_aligned(size_t align, size_t size)
+{
+	int cls = alloc_class(size ? size : 1);
+	void *ptr;
+
+	/* the large block offset has to stay within the first chunk */
+	if (align & (align - 1) || align > ALLOC_CHUNK_SIZE / 2) {
+		errno = EINVAL;
+
+		return NULL;
+	}
+
+	alloc_lock();
+
+	if (cls != ALLOC_LARGE && align <= 16)
+		ptr = alloc_small(cls);
+	else
+		ptr = alloc_large(size, align);
+
+	alloc_unlock();
+
+	if (!ptr)
+		errno = ENOMEM;
+
+	return ptr;
+}
+
+void *
+malloc(size_t size)
+{
+	return alloc_aligned(16, size);
+}
+
+void
+free(void *ptr)
+{
+	alloc_chunk_t *c;
+
+	if (!ptr)
+		return;
+
+	c = alloc_chunk(ptr);
+
+	alloc_lock();
+
+	if (c->cls == ALLOC_LARGE) {
+		heap.stats.large--;
+		heap.stats.large_bytes -= c->size;
+		alloc_account(-(ssize_t)c->size);
+		alloc_large_release(c);
+	}
+	else {
+		alloc_small_free(c, ptr);
+	}
+
+	alloc_unlock();
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+
+		return NULL;
+	}
+
+	/* not via malloc(), the compiler would turn malloc() + memset() into a
+	 * call to calloc() itself */
+	ptr = alloc_aligned(16, nmemb * size);
+
+	if (ptr)
+		memset(ptr, 0, nmemb * size);
+
+	return ptr;
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	size_t old;
+	void *p;
+
+	if (!ptr)
+		return malloc(size);
+
+	if (!size) {
+		free(ptr);
+
+		return NULL;
+	}
+
+	/* keep the block unless it would waste more than half of it */
+	old = alloc_usable(ptr);
+
+	if (size <= old && size > old / 2)
+		return ptr;
+
+	p = malloc(size);
+
+	if (!p)
+		return NULL;
+
+	memcpy(p, ptr, (size < old) ? size : old);
+	free(ptr);
+
+	return p;
+}
+
+int
+posix_memalign(void **memptr, size_t align, size_t size)
+{
+	void *ptr;
+
+	if (align < sizeof(void *))
+		return EINVAL;
+
+	ptr = alloc_aligned(align, size);
+
+	if (!ptr)
+		return errno;
+
+	*memptr = ptr;
+
+	return 0;
+}
+
+void *
+aligned_alloc(size_t align, size_t size)
+{
+	return alloc_aligned(align, size);
+}
+
+void *
+memalign(size_t align, size_t size)
+{
+	return alloc_aligned(align, size);
+}
+
+void *
+valloc(size_t size)
+{
+	return alloc_aligned(sysconf(_SC_PAGESIZE), size);
+}
+
+void *
+pvalloc(size_t size)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+
+	return alloc_aligned(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+size_t
+malloc_usable_size(void *ptr)
+{
+	return ptr ? alloc_usable(ptr) : 0;
+}
+
+size_t
+alloc_usage(void)
+{
+	return heap.stats.usage;
+}
+
+void
+alloc_limit(size_t limit)
+{
+	heap.stats.limit = limit;
+}
+
+void
+alloc_trim(void)
+{
+	alloc_chunk_t *c;
+
+	alloc_lock();
+
+	while ((c = heap.empty) != NULL) {
+		heap.empty = c->next;
+		alloc_unmap(c, ALLOC_CHUNK_SIZE);
+	}
+
+	heap.nempty = 0;
+
+	while ((c = heap.cache) != NULL) {
+		heap.cache = c->next;
+		alloc_unmap(c, c->size);
+	}
+
+	heap.ncache = 0;
+
+	alloc_unlock();
+}
+
+void
+alloc_stats(ucrun_alloc_stats_t *stats)
+{
+	int cls;
+
+	alloc_lock();
+	*stats = heap.stats;
+	alloc_unlock();
+
+	for (cls = 0; cls < UCRUN_ALLOC_CLASSES; cls++)
+		stats->classes[cls].size = alloc_sizes[cls];
+}
+
+#else
+
+size_t
+alloc_usage(void)
+{
+	unsigned long size, resident, shared;
+	size_t usage = 0;
+	char buf[128];
+	ssize_t len;
+	int fd;
+
+	fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if (len <= 0)
+		return 0;
+
+	buf[len] = 0;
+
+	if (sscanf(buf, "%lu %lu %lu", &size, &resident, &shared) == 3 && resident > shared)
+		usage = (resident - shared) * sysconf(_SC_PAGESIZE);
+
+	return usage;
+}
+
+void
+alloc_limit(size_t limit)
+{
+}
+
+void
+alloc_trim(void)
+{
+}
+
+void
+alloc_stats(ucrun_alloc_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->usage = stats->peak = alloc_usage();
+}
+
+#endif
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2021 Jo-Philipp Wich <jo@mein.io>
+ * Copyright (C) 2021 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "../ucrun.h"
+
+/*
+ * Replays the allocation pattern of a ubus handler: every request converts
+ * a status message of 12 stations into ucode values and passes it to a
+ * script function which builds a reply and keeps the last 64 replies
+ * alive. Built as ucrun-bench-alloc with the ucrun allocator and as
+ * ucrun-bench-alloc-libc with the libc one, compare both outputs.
+ */
+
+static const char script[] =
+	"let keep = [], n = 0;\n"
+	"global.handle = function(msg) {\n"
+	"	let reply = {\n"
+	"		ifname: msg.ifname,\n"
+	"		stations: map(msg.stations, (s) => ({\n"
+	"			mac: s.mac,\n"
+	"			signal: s.signal,\n"
+	"			label: sprintf('%s/%d/%d', s.mac, s.signal, n)\n"
+	"		}))\n"
+	"	};\n"
+	"	keep[n++ % 64] = reply;\n"
+	"	return reply;\n"
+	"};\n";
+
+static uc_parse_config_t config = {
+	.strict_declarations = true,
+	.raw_mode = true,
+};
+
+static ucrun_ctx_t ucrun;
+static struct blob_buf b;
+
+static void
+build_status(void)
+{
+	char mac[sizeof("00:00:00:00:00:00")];
+	void *stations, *sta;
+	int i;
+
+	blob_buf_init(&b, 0);
+
+	blobmsg_add_string(&b, "ifname", "wlan0");
+	blobmsg_add_string(&b, "ssid", "OpenWrt");
+	blobmsg_add_u32(&b, "channel", 36);
+
+	stations = blobmsg_open_array(&b, "stations");
+
+	for (i = 0; i < 12; i++) {
+		snprintf(mac, sizeof(mac), "02:00:00:00:01:%02x", i);
+
+		sta = blobmsg_open_table(&b, NULL);
+		blobmsg_add_string(&b, "mac", mac);
+		blobmsg_add_u32(&b, "signal", -40 - i);
+		blobmsg_add_u64(&b, "rx_bytes", 1000000ULL * i);
+		blobmsg_add_u64(&b, "tx_bytes", 2000000ULL * i);
+		blobmsg_close_table(&b, sta);
+	}
+
+	blobmsg_close_array(&b, stations);
+}
+
+static uc_program_t *
+load(void)
+{
+	char path[] = "/tmp/ucrun-bench-XXXXXX";
+	char *syntax_error = NULL;
+	uc_program_t *prog;
+	uc_source_t *src;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return NULL;
+
+	if (write(fd, script, sizeof(script) - 1) < 0) {}
+	close(fd);
+
+	src = uc_source_new_file(path);
+	unlink(path);
+
+	if (!src)
+		return NULL;
+
+	prog = uc_compile(&config, src, &syntax_error);
+	uc_source_put(src);
+
+	if (!prog)
+		fprintf(stderr, "Failed to compile benchmark: %s\n", syntax_error);
+
+	free(syntax_error);
+
+	return prog;
+}
+
+static double
+run(int iterations)
+{
+	uc_value_t *fn = ucv_object_get(ucrun.scope, "handle", NULL);
+	struct timespec start, end;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < iterations; i++) {
+		uc_vm_stack_push(&ucrun.vm, ucv_get(fn));
+		uc_vm_stack_push(&ucrun.vm,
+			uc_blob_array_to_json(&ucrun.vm, blob_data(b.head), blob_len(b.head), true));
+
+		if (!uc_vm_call(&ucrun.vm, false, 1))
+			ucv_put(uc_vm_stack_pop(&ucrun.vm));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+}
+
+/* peak resident set size in KiB */
+static long
+hwm(void)
+{
+	char line[128];
+	long kb = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/status", "r");
+	if (!fp)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+			break;
+
+	fclose(fp);
+
+	return kb;
+}
+
+int main(int argc, const char **argv)
+{
+	int iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+	uc_value_t *retval = NULL;
+	ucrun_alloc_stats_t heap;
+	double ns;
+
+	uc_vm_init(&ucrun.vm, &config);
+	ucrun.scope = uc_vm_scope_get(&ucrun.vm);
+	uc_stdlib_load(ucrun.scope);
+	build_status();
+
+	ucrun.prog = load();
+	if (!ucrun.prog)
+		return 1;
+
+	uc_vm_execute(&ucrun.vm, ucrun.prog, &retval);
+	ucv_put(retval);
+
+	ns = run(iterations);
+	alloc_stats(&heap);
+
+	printf("ubus handler, 12 stations, 64 replies kept: %8.0f ns/op\n", ns);
+	printf("heap in use: %zu KiB, heap peak: %zu KiB, VmHWM: %ld KiB\n",
+	       heap.usage / 1024, heap.peak / 1024, hwm());
+
+	ubus_intern_free(&ucrun);
+	uc_program_put(ucrun.prog);
+	blob_buf_free(&b);
+	uc_vm_free(&ucrun.vm);
+
+	return 0;
+}
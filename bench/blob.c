@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2021 Jo-Philipp Wich <jo@mein.io>
+ * Copyright (C) 2021 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <time.h>
+
+#include "../ucrun.h"
+
+/*
+ * Converts a wireless status message of 200 fields (20 interface fields
+ * plus 12 stations of 15 fields each) into ucode values, the way
+ * ubus_ucode_cb() does for every incoming request.
+ */
+
+static uc_parse_config_t config = {
+	.strict_declarations = true,
+	.raw_mode = true,
+};
+
+static ucrun_ctx_t ucrun;
+static struct blob_buf b;
+
+static void
+build_status(void)
+{
+	static const char *states[] = { "authorized", "associated", "authenticated" };
+	char mac[sizeof("00:00:00:00:00:00")];
+	void *stations, *sta;
+	int i;
+
+	blob_buf_init(&b, 0);
+
+	blobmsg_add_string(&b, "ifname", "wlan0");
+	blobmsg_add_string(&b, "mode", "ap");
+	blobmsg_add_string(&b, "ssid", "OpenWrt");
+	blobmsg_add_string(&b, "bssid", "02:00:00:00:00:01");
+	blobmsg_add_string(&b, "country", "DE");
+	blobmsg_add_string(&b, "hwmode", "11ax");
+	blobmsg_add_string(&b, "htmode", "HE80");
+	blobmsg_add_string(&b, "encryption", "wpa3-sae");
+	blobmsg_add_string(&b, "state", "enabled");
+	blobmsg_add_u32(&b, "channel", 36);
+	blobmsg_add_u32(&b, "frequency", 5180);
+	blobmsg_add_u32(&b, "txpower", 23);
+	blobmsg_add_u32(&b, "noise", -95);
+	blobmsg_add_u32(&b, "quality", 70);
+	blobmsg_add_u32(&b, "quality_max", 70);
+	blobmsg_add_u64(&b, "rx_bytes", 123456789012ULL);
+	blobmsg_add_u64(&b, "tx_bytes", 987654321098ULL);
+	blobmsg_add_u8(&b, "up", true);
+	blobmsg_add_u8(&b, "disabled", false);
+
+	stations = blobmsg_open_array(&b, "stations");
+
+	for (i = 0; i < 12; i++) {
+		snprintf(mac, sizeof(mac), "02:00:00:00:01:%02x", i);
+
+		sta = blobmsg_open_table(&b, NULL);
+		blobmsg_add_string(&b, "mac", mac);
+		blobmsg_add_string(&b, "state", states[i % 3]);
+		blobmsg_add_string(&b, "mode", "he");
+		blobmsg_add_string(&b, "cipher", "ccmp");
+		blobmsg_add_string(&b, "akm", "sae");
+		blobmsg_add_u32(&b, "signal", -40 - i);
+		blobmsg_add_u32(&b, "noise", -95);
+		blobmsg_add_u32(&b, "inactive", i * 10);
+		blobmsg_add_u32(&b, "rx_rate", 1200000);
+		blobmsg_add_u32(&b, "tx_rate", 960000);
+		blobmsg_add_u64(&b, "rx_bytes", 1000000ULL * i);
+		blobmsg_add_u64(&b, "tx_bytes", 2000000ULL * i);
+		blobmsg_add_u64(&b, "connected_time", 3600 + i);
+		blobmsg_add_u8(&b, "wmm", true);
+		blobmsg_add_u8(&b, "mfp", true);
+		blobmsg_close_table(&b, sta);
+	}
+
+	blobmsg_close_array(&b, stations);
+}
+
+/* the conversion as it was before interning, every string is a fresh copy */
+static uc_value_t *
+baseline_to_ucode(uc_vm_t *vm, struct blob_attr *attr, size_t len, bool table)
+{
+	uc_value_t *o = table ? ucv_object_new(vm) : ucv_array_new(vm);
+	struct blob_attr *pos;
+	size_t rem = len;
+	uc_value_t *v;
+
+	__blob_for_each_attr(pos, attr, rem) {
+		switch (blob_id(pos)) {
+		case BLOBMSG_TYPE_BOOL:
+			v = ucv_boolean_new(blobmsg_get_u8(pos));
+			break;
+
+		case BLOBMSG_TYPE_INT32:
+			v = ucv_int64_new((int32_t)blobmsg_get_u32(pos));
+			break;
+
+		case BLOBMSG_TYPE_INT64:
+			v = ucv_int64_new((int64_t)blobmsg_get_u64(pos));
+			break;
+
+		case BLOBMSG_TYPE_STRING:
+			v = ucv_string_new(blobmsg_get_string(pos));
+			break;
+
+		case BLOBMSG_TYPE_ARRAY:
+		case BLOBMSG_TYPE_TABLE:
+			v = baseline_to_ucode(vm, blobmsg_data(pos), blobmsg_data_len(pos),
+					      blob_id(pos) == BLOBMSG_TYPE_TABLE);
+			break;
+
+		default:
+			v = NULL;
+			break;
+		}
+
+		if (table)
+			ucv_object_add(o, blobmsg_name(pos), v);
+		else
+			ucv_array_push(o, v);
+	}
+
+	return o;
+}
+
+enum {
+	MODE_BASELINE,
+	MODE_COLD,
+	MODE_WARM,
+};
+
+static double
+run(int iterations, int mode)
+{
+	struct timespec start, end;
+	uc_value_t *val;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < iterations; i++) {
+		if (mode == MODE_BASELINE) {
+			val = baseline_to_ucode(&ucrun.vm, blob_data(b.head), blob_len(b.head), true);
+			ucv_put(val);
+			continue;
+		}
+
+		/* an empty intern table shows the cost of the first requests */
+		if (mode == MODE_COLD)
+			ubus_intern_free(&ucrun);
+
+		val = uc_blob_array_to_json(&ucrun.vm, blob_data(b.head), blob_len(b.head), true);
+		ucv_put(val);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+}
+
+int main(int argc, const char **argv)
+{
+	int iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+
+	uc_vm_init(&ucrun.vm, &config);
+	build_status();
+
+	/* warm up caches and the intern table */
+	run(iterations / 10 + 1, MODE_BASELINE);
+	run(iterations / 10 + 1, MODE_WARM);
+
+	printf("blob->ucode 200 fields, baseline copies:   %8.0f ns/op\n", run(iterations, MODE_BASELINE));
+	printf("blob->ucode 200 fields, cold intern table: %8.0f ns/op\n", run(iterations, MODE_COLD));
+	printf("blob->ucode 200 fields, warm intern table: %8.0f ns/op\n", run(iterations, MODE_WARM));
+
+	ubus_intern_free(&ucrun);
+	blob_buf_free(&b);
+	uc_vm_free(&ucrun.vm);
+
+	return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2021 Jo-Philipp Wich <jo@mein.io>
+ * Copyright (C) 2021 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "../ucrun.h"
+
+/*
+ * Runs a script function that calls a native function on every loop
+ * iteration once with the profiler stopped and once while sampling at the
+ * default rate, which adds the SIGPROF handler and one dispatch of the VM
+ * signal handler per tick.
+ */
+
+static const char script[] =
+	"global.work = function(n) {\n"
+	"	let s = 0;\n"
+	"	for (let i = 0; i < n; i++)\n"
+	"		s += length(sprintf('%d', i));\n"
+	"	return s;\n"
+	"};\n";
+
+static uc_parse_config_t config = {
+	.strict_declarations = true,
+	.raw_mode = true,
+	.setup_signal_handlers = true,
+};
+
+static ucrun_ctx_t ucrun;
+
+static void
+call(const char *name, uc_value_t *arg)
+{
+	uc_vm_stack_push(&ucrun.vm, ucv_get(ucv_object_get(ucrun.scope, name, NULL)));
+
+	if (arg)
+		uc_vm_stack_push(&ucrun.vm, arg);
+
+	if (!uc_vm_call(&ucrun.vm, false, arg ? 1 : 0))
+		ucv_put(uc_vm_stack_pop(&ucrun.vm));
+}
+
+static double
+run(int iterations)
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	call("work", ucv_int64_new(iterations));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+}
+
+static uc_program_t *
+load(void)
+{
+	char path[] = "/tmp/ucrun-bench-XXXXXX";
+	char *syntax_error = NULL;
+	uc_program_t *prog;
+	uc_source_t *src;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return NULL;
+
+	if (write(fd, script, sizeof(script) - 1) < 0) {}
+	close(fd);
+
+	src = uc_source_new_file(path);
+	unlink(path);
+
+	if (!src)
+		return NULL;
+
+	prog = uc_compile(&config, src, &syntax_error);
+	uc_source_put(src);
+
+	if (!prog)
+		fprintf(stderr, "Failed to compile benchmark: %s\n", syntax_error);
+
+	free(syntax_error);
+
+	return prog;
+}
+
+int main(int argc, const char **argv)
+{
+	int iterations = (argc > 1) ? atoi(argv[1]) : 1000000;
+	uc_value_t *retval = NULL;
+	double off, on;
+
+	uc_vm_init(&ucrun.vm, &config);
+	ucrun.scope = uc_vm_scope_get(&ucrun.vm);
+	uc_stdlib_load(ucrun.scope);
+	profiler_register(&ucrun);
+
+	ucrun.prog = load();
+	if (!ucrun.prog)
+		return 1;
+
+	uc_vm_execute(&ucrun.vm, ucrun.prog, &retval);
+	ucv_put(retval);
+
+	/* warm up */
+	run(iterations / 10 + 1);
+
+	off = run(iterations);
+
+	call("profiler_start", NULL);
+	on = run(iterations);
+	call("profiler_stop", NULL);
+
+	printf("native call loop, profiler off: %8.1f ns/iteration\n", off);
+	printf("native call loop, profiler on:  %8.1f ns/iteration (%+.1f%%)\n",
+	       on, (on - off) * 100 / off);
+
+	profiler_deinit(&ucrun);
+	uc_program_put(ucrun.prog);
+	uc_vm_free(&ucrun.vm);
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2021 Jo-Philipp Wich <jo@mein.io>
+ * Copyright (C) 2021 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <time.h>
+
+#include "ucrun.h"
+
+/*
+ * The budget is checked against the heap usage tracked by the allocator,
+ * see alloc.c, whenever a native function or a ubus request is about to
+ * allocate on behalf of the script. Exceeding it triggers a garbage
+ * collection run, after which cached empty slabs are returned to the
+ * kernel, and if that did not help a catchable exception. Usage has to
+ * drop clearly below the limit before allocations are allowed again and
+ * the collector runs at a bounded rate so that checks stay cheap.
+ *
+ * Scripts that allocate without calling into ucrun never reach these
+ * checks, the allocator itself therefore refuses to grow more than a
+ * quarter beyond the limit, which terminates the process.
+ */
+
+#define MEMORY_GC_MS		1000
+
+size_t
+memory_usage(void)
+{
+	return alloc_usage();
+}
+
+static uint64_t
+memory_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+memory_update(ucrun_ctx_t *ucrun)
+{
+	size_t usage = alloc_usage();
+
+	/* only leave the over budget state once usage dropped below the low mark */
+	if (usage > ucrun->mem_limit)
+		ucrun->mem_over = true;
+	else if (usage <= ucrun->mem_limit - ucrun->mem_limit / 8)
+		ucrun->mem_over = false;
+}
+
+bool
+memory_check(ucrun_ctx_t *ucrun)
+{
+	uint64_t now;
+
+	if (!ucrun->mem_limit)
+		return true;
+
+	memory_update(ucrun);
+
+	if (!ucrun->mem_over)
+		return true;
+
+	/* cyclic garbage might be all that is in the way, but a full run is expensive */
+	now = memory_now();
+
+	if (now - ucrun->mem_gc >= MEMORY_GC_MS) {
+		ucrun->mem_gc = now;
+		ucv_gc(&ucrun->vm);
+		alloc_trim();
+		memory_update(ucrun);
+	}
+
+	return !ucrun->mem_over;
+}
+
+bool
+memory_guard(uc_vm_t *vm)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+
+	if (memory_check(ucrun))
+		return true;
+
+	uc_vm_raise_exception(vm, EXCEPTION_RUNTIME,
+			      "Out of memory - limit of %zu bytes exceeded", ucrun->mem_limit);
+
+	return false;
+}
+
+static uc_value_t *
+uc_memory_stats(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	uc_value_t *stats = ucv_object_new(vm);
+	uc_value_t *classes = ucv_array_new(vm);
+	uc_value_t *large = ucv_object_new(vm);
+	ucrun_alloc_stats_t heap;
+	uc_value_t *class;
+	int i;
+
+	alloc_stats(&heap);
+
+	ucv_object_add(stats, "current", ucv_uint64_new(heap.usage));
+	ucv_object_add(stats, "peak", ucv_uint64_new(heap.peak));
+	ucv_object_add(stats, "mapped", ucv_uint64_new(heap.mapped));
+	ucv_object_add(stats, "limit", ucv_uint64_new(ucrun->mem_limit));
+
+	for (i = 0; i < UCRUN_ALLOC_CLASSES; i++) {
+		if (!heap.classes[i].size)
+			continue;
+
+		class = ucv_object_new(vm);
+		ucv_object_add(class, "size", ucv_uint64_new(heap.classes[i].size));
+		ucv_object_add(class, "used", ucv_uint64_new(heap.classes[i].used));
+		ucv_object_add(class, "peak", ucv_uint64_new(heap.classes[i].peak));
+		ucv_object_add(class, "slabs", ucv_uint64_new(heap.classes[i].slabs));
+		ucv_array_push(classes, class);
+	}
+
+	ucv_object_add(large, "count", ucv_uint64_new(heap.large));
+	ucv_object_add(large, "bytes", ucv_uint64_new(heap.large_bytes));
+
+	ucv_object_add(stats, "classes", classes);
+	ucv_object_add(stats, "large", large);
+
+	return stats;
+}
+
+void
+memory_register(ucrun_ctx_t *ucrun)
+{
+	uc_function_register(ucrun->scope, "memory_stats", uc_memory_stats);
+}
+
+void
+memory_init(ucrun_ctx_t *ucrun, size_t limit)
+{
+	ucrun->mem_limit = limit;
+	alloc_limit(limit + limit / 4);
+}
@@ -0,0 +1,539 @@
+/*
+ * Copyright (C) 2021 Jo-Philipp Wich <jo@mein.io>
+ * Copyright (C) 2021 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "ucrun.h"
+
+/*
+ * Metrics live in a segment laid out as described in metrics.h. Until the
+ * script declares an export path the segment is anonymous memory, once
+ * declared its contents move to a file which collectors can map. Script
+ * handles refer to their slot by index, so they survive that move.
+ *
+ * The first slots hold the runtime internals, they are refreshed from the
+ * context once per interval while exported and on every text dump.
+ */
+
+#define METRICS_INTERVAL	1000
+
+enum {
+	METRICS_RT_TIMEOUTS,
+	METRICS_RT_PROCESSES,
+	METRICS_RT_FDS,
+	METRICS_RT_STREAMS,
+	METRICS_RT_TASKS,
+	METRICS_RT_TASK_SLICES,
+	METRICS_RT_MEMORY,
+	__METRICS_RT_MAX
+};
+
+static const char * const metrics_rt_names[__METRICS_RT_MAX] = {
+	[METRICS_RT_TIMEOUTS] = "ucrun_timeouts",
+	[METRICS_RT_PROCESSES] = "ucrun_processes",
+	[METRICS_RT_FDS] = "ucrun_fds",
+	[METRICS_RT_STREAMS] = "ucrun_streams",
+	[METRICS_RT_TASKS] = "ucrun_tasks",
+	[METRICS_RT_TASK_SLICES] = "ucrun_task_slices",
+	[METRICS_RT_MEMORY] = "ucrun_memory_bytes",
+};
+
+static const double metrics_default_bounds[] = {
+	0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static const char * const metrics_type_names[] = {
+	[UCRUN_METRIC_COUNTER] = "counter",
+	[UCRUN_METRIC_GAUGE] = "gauge",
+	[UCRUN_METRIC_HISTOGRAM] = "histogram",
+};
+
+static uc_resource_type_t *metric_type;
+
+static void
+metrics_begin(struct ucrun_metric *m)
+{
+	__atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+metrics_end(struct ucrun_metric *m)
+{
+	__atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+metrics_set(struct ucrun_metric *m, int64_t value)
+{
+	metrics_begin(m);
+	m->value = value;
+	metrics_end(m);
+}
+
+static bool
+metrics_valid_name(const char *name)
+{
+	const char *p;
+
+	if (!*name || strlen(name) >= UCRUN_METRICS_NAME_LEN || isdigit((unsigned char)*name))
+		return false;
+
+	for (p = name; *p; p++)
+		if (!isalnum((unsigned char)*p) && *p != '_' && *p != ':')
+			return false;
+
+	return true;
+}
+
+static int
+metrics_add(ucrun_ctx_t *ucrun, const char *name, int type,
+	    const double *bounds, size_t nbounds)
+{
+	struct ucrun_metrics *seg = ucrun->metrics;
+	struct ucrun_metric *m;
+	uint32_t i;
+
+	for (i = 0; i < seg->hdr.count; i++)
+		if (!strcmp(seg->slots[i].name, name))
+			return (seg->slots[i].type == type) ? (int)i : -1;
+
+	if (seg->hdr.count >= seg->hdr.nslots)
+		return -1;
+
+	m = &seg->slots[seg->hdr.count];
+	memset(m, 0, sizeof(*m));
+	strcpy(m->name, name);
+	m->type = type;
+
+	if (type == UCRUN_METRIC_HISTOGRAM) {
+		m->nbuckets = nbounds + 1;
+		memcpy(m->bounds, bounds, nbounds * sizeof(*bounds));
+	}
+
+	/* only publish the slot once it is complete */
+	__atomic_store_n(&seg->hdr.count, seg->hdr.count + 1, __ATOMIC_RELEASE);
+
+	return i;
+}
+
+static size_t
+metrics_list_len(struct list_head *head)
+{
+	struct list_head *p;
+	size_t len = 0;
+
+	list_for_each(p, head)
+		len++;
+
+	return len;
+}
+
+static void
+metrics_refresh(ucrun_ctx_t *ucrun)
+{
+	struct ucrun_metric *rt = ucrun->metrics->slots;
+
+	metrics_set(&rt[METRICS_RT_TIMEOUTS], metrics_list_len(&ucrun->timeout));
+	metrics_set(&rt[METRICS_RT_PROCESSES], metrics_list_len(&ucrun->process));
+	metrics_set(&rt[METRICS_RT_FDS], metrics_list_len(&ucrun->fd));
+	metrics_set(&rt[METRICS_RT_STREAMS], metrics_list_len(&ucrun->stream));
+	metrics_set(&rt[METRICS_RT_TASKS], metrics_list_len(&ucrun->task));
+	metrics_set(&rt[METRICS_RT_TASK_SLICES], ucrun->task_slices);
+	metrics_set(&rt[METRICS_RT_MEMORY], memory_usage());
+}
+
+static void
+metrics_timeout_cb(struct uloop_timeout *t)
+{
+	ucrun_ctx_t *ucrun = container_of(t, ucrun_ctx_t, metrics_timeout);
+
+	metrics_refresh(ucrun);
+	uloop_timeout_set(t, METRICS_INTERVAL);
+}
+
+static double
+metrics_number(uc_value_t *v)
+{
+	if (ucv_type(v) == UC_DOUBLE)
+		return ucv_double_get(v);
+
+	return (double)ucv_int64_get(v);
+}
+
+static struct ucrun_metric *
+metrics_this(uc_vm_t *vm, int type)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	void **slot = (void **)uc_fn_this("ucrun.metric");
+	struct ucrun_metric *m;
+
+	if (!slot || !ucrun->metrics)
+		return NULL;
+
+	m = &ucrun->metrics->slots[(uintptr_t)*slot];
+
+	if (type && m->type != type)
+		return NULL;
+
+	return m;
+}
+
+static uc_value_t *
+metrics_handle(uc_vm_t *vm, size_t nargs, int type)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	uc_value_t *name = uc_fn_arg(0);
+	uc_value_t *bounds = uc_fn_arg(1);
+	double bound[UCRUN_METRICS_BUCKETS - 1];
+	size_t nbounds = 0, i;
+	int slot;
+
+	/* check if the call signature is correct */
+	if (!ucrun->metrics || ucv_type(name) != UC_STRING ||
+	    !metrics_valid_name(ucv_string_get(name)) ||
+	    (bounds && ucv_type(bounds) != UC_ARRAY))
+		return ucv_int64_new(-1);
+
+	if (type == UCRUN_METRIC_HISTOGRAM && !bounds) {
+		nbounds = ARRAY_SIZE(metrics_default_bounds);
+		memcpy(bound, metrics_default_bounds, sizeof(metrics_default_bounds));
+	}
+	else if (type == UCRUN_METRIC_HISTOGRAM) {
+		nbounds = ucv_array_length(bounds);
+
+		if (!nbounds || nbounds > ARRAY_SIZE(bound))
+			return ucv_int64_new(-1);
+
+		/* bucket bounds need to be numbers in ascending order */
+		for (i = 0; i < nbounds; i++) {
+			uc_value_t *b = ucv_array_get(bounds, i);
+
+			if (ucv_type(b) != UC_INTEGER && ucv_type(b) != UC_DOUBLE)
+				return ucv_int64_new(-1);
+
+			bound[i] = metrics_number(b);
+
+			if (i && bound[i] <= bound[i - 1])
+				return ucv_int64_new(-1);
+		}
+	}
+
+	slot = metrics_add(ucrun, ucv_string_get(name), type, bound, nbounds);
+
+	/* the runtime internals are published from the context only */
+	if (slot < __METRICS_RT_MAX)
+		return ucv_int64_new(-1);
+
+	return ucv_resource_new(metric_type, (void *)(uintptr_t)slot);
+}
+
+static uc_value_t *
+uc_metrics_counter(uc_vm_t *vm, size_t nargs)
+{
+	return metrics_handle(vm, nargs, UCRUN_METRIC_COUNTER);
+}
+
+static uc_value_t *
+uc_metrics_gauge(uc_vm_t *vm, size_t nargs)
+{
+	return metrics_handle(vm, nargs, UCRUN_METRIC_GAUGE);
+}
+
+static uc_value_t *
+uc_metrics_histogram(uc_vm_t *vm, size_t nargs)
+{
+	return metrics_handle(vm, nargs, UCRUN_METRIC_HISTOGRAM);
+}
+
+static uc_value_t *
+metrics_add_value(uc_vm_t *vm, size_t nargs, int64_t sign)
+{
+	struct ucrun_metric *m = metrics_this(vm, 0);
+	uc_value_t *n = uc_fn_arg(0);
+	int64_t delta = n ? ucv_int64_get(n) : 1;
+
+	/* counters only ever go up */
+	if (!m || m->type == UCRUN_METRIC_HISTOGRAM ||
+	    (n && ucv_type(n) != UC_INTEGER) ||
+	    (m->type == UCRUN_METRIC_COUNTER && (sign < 0 || delta < 0)))
+		return ucv_int64_new(-1);
+
+	metrics_set(m, m->value + sign * delta);
+
+	return ucv_int64_new(0);
+}
+
+static uc_value_t *
+uc_metric_inc(uc_vm_t *vm, size_t nargs)
+{
+	return metrics_add_value(vm, nargs, 1);
+}
+
+static uc_value_t *
+uc_metric_dec(uc_vm_t *vm, size_t nargs)
+{
+	return metrics_add_value(vm, nargs, -1);
+}
+
+static uc_value_t *
+uc_metric_set(uc_vm_t *vm, size_t nargs)
+{
+	struct ucrun_metric *m = metrics_this(vm, UCRUN_METRIC_GAUGE);
+	uc_value_t *value = uc_fn_arg(0);
+
+	if (!m || ucv_type(value) != UC_INTEGER)
+		return ucv_int64_new(-1);
+
+	metrics_set(m, ucv_int64_get(value));
+
+	return ucv_int64_new(0);
+}
+
+static uc_value_t *
+uc_metric_observe(uc_vm_t *vm, size_t nargs)
+{
+	struct ucrun_metric *m = metrics_this(vm, UCRUN_METRIC_HISTOGRAM);
+	uc_value_t *value = uc_fn_arg(0);
+	double v;
+	int i;
+
+	if (!m || (ucv_type(value) != UC_INTEGER && ucv_type(value) != UC_DOUBLE))
+		return ucv_int64_new(-1);
+
+	v = metrics_number(value);
+
+	for (i = 0; i < m->nbuckets - 1; i++)
+		if (v <= m->bounds[i])
+			break;
+
+	metrics_begin(m);
+	m->buckets[i]++;
+	m->value++;
+	m->sum += v;
+	metrics_end(m);
+
+	return ucv_int64_new(0);
+}
+
+static uc_value_t *
+uc_metric_get(uc_vm_t *vm, size_t nargs)
+{
+	struct ucrun_metric *m = metrics_this(vm, 0);
+	uc_value_t *rv, *buckets;
+	uint64_t total = 0;
+	int i;
+
+	if (!m)
+		return NULL;
+
+	if (m->type != UCRUN_METRIC_HISTOGRAM)
+		return ucv_int64_new(m->value);
+
+	rv = ucv_object_new(vm);
+	buckets = ucv_array_new(vm);
+
+	/* bucket counts are cumulative, like in the text exposition */
+	for (i = 0; i < m->nbuckets; i++) {
+		total += m->buckets[i];
+		ucv_array_push(buckets, ucv_uint64_new(total));
+	}
+
+	ucv_object_add(rv, "count", ucv_int64_new(m->value));
+	ucv_object_add(rv, "sum", ucv_double_new(m->sum));
+	ucv_object_add(rv, "buckets", buckets);
+
+	return rv;
+}
+
+static uc_value_t *
+uc_metrics_dump(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	struct ucrun_metric *m;
+	uint64_t total;
+	uc_value_t *rv;
+	char *buf = NULL;
+	size_t len = 0;
+	uint32_t i;
+	FILE *fp;
+	int b;
+
+	if (!ucrun->metrics)
+		return NULL;
+
+	metrics_refresh(ucrun);
+
+	fp = open_memstream(&buf, &len);
+	if (!fp)
+		return NULL;
+
+	for (i = 0; i < ucrun->metrics->hdr.count; i++) {
+		m = &ucrun->metrics->slots[i];
+
+		fprintf(fp, "# TYPE %s %s\n", m->name, metrics_type_names[m->type]);
+
+		if (m->type != UCRUN_METRIC_HISTOGRAM) {
+			fprintf(fp, "%s %" PRId64 "\n", m->name, m->value);
+			continue;
+		}
+
+		for (b = 0, total = 0; b < m->nbuckets; b++) {
+			total += m->buckets[b];
+
+			if (b < m->nbuckets - 1)
+				fprintf(fp, "%s_bucket{le=\"%g\"} %" PRIu64 "\n",
+					m->name, m->bounds[b], total);
+			else
+				fprintf(fp, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n",
+					m->name, total);
+		}
+
+		fprintf(fp, "%s_sum %g\n", m->name, m->sum);
+		fprintf(fp, "%s_count %" PRId64 "\n", m->name, m->value);
+	}
+
+	fclose(fp);
+
+	rv = ucv_string_new_length(buf, len);
+	free(buf);
+
+	return rv;
+}
+
+static const uc_function_list_t metric_fns[] = {
+	{ "inc",	uc_metric_inc },
+	{ "dec",	uc_metric_dec },
+	{ "set",	uc_metric_set },
+	{ "observe",	uc_metric_observe },
+	{ "get",	uc_metric_get },
+};
+
+void
+metrics_register(ucrun_ctx_t *ucrun)
+{
+	struct ucrun_metrics *seg;
+	int i;
+
+	metric_type = uc_type_declare(&ucrun->vm, "ucrun.metric", metric_fns, NULL);
+
+	uc_function_register(ucrun->scope, "metrics_counter", uc_metrics_counter);
+	uc_function_register(ucrun->scope, "metrics_gauge", uc_metrics_gauge);
+	uc_function_register(ucrun->scope, "metrics_histogram", uc_metrics_histogram);
+	uc_function_register(ucrun->scope, "metrics_dump", uc_metrics_dump);
+
+	seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (seg == MAP_FAILED)
+		return;
+
+	seg->hdr.magic = UCRUN_METRICS_MAGIC;
+	seg->hdr.version = UCRUN_METRICS_VERSION;
+	seg->hdr.pid = getpid();
+	seg->hdr.nslots = UCRUN_METRICS_SLOTS;
+
+	ucrun->metrics = seg;
+	ucrun->metrics_timeout.cb = metrics_timeout_cb;
+
+	/* the runtime internals always occupy the first slots */
+	for (i = 0; i < __METRICS_RT_MAX; i++)
+		metrics_add(ucrun, metrics_rt_names[i],
+			    (i == METRICS_RT_TASK_SLICES) ? UCRUN_METRIC_COUNTER : UCRUN_METRIC_GAUGE,
+			    NULL, 0);
+}
+
+void
+metrics_init(ucrun_ctx_t *ucrun, const char *path)
+{
+	struct ucrun_metrics *seg;
+	char *tmp;
+	int fd;
+
+	if (!ucrun->metrics || ucrun->metrics_path)
+		return;
+
+	tmp = malloc(strlen(path) + sizeof(".tmp"));
+	if (!tmp)
+		return;
+
+	sprintf(tmp, "%s.tmp", path);
+
+	/* build the file aside so collectors never map a partial segment */
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to create metrics segment %s: %m\n", tmp);
+		free(tmp);
+		return;
+	}
+
+	seg = MAP_FAILED;
+
+	if (!ftruncate(fd, sizeof(*seg)))
+		seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (seg == MAP_FAILED) {
+		fprintf(stderr, "Unable to map metrics segment %s: %m\n", tmp);
+		goto err;
+	}
+
+	memcpy(seg, ucrun->metrics, sizeof(*seg));
+
+	if (rename(tmp, path)) {
+		fprintf(stderr, "Unable to publish metrics segment %s: %m\n", path);
+		munmap(seg, sizeof(*seg));
+		goto err;
+	}
+
+	munmap(ucrun->metrics, sizeof(*seg));
+	ucrun->metrics = seg;
+	ucrun->metrics_path = strdup(path);
+	free(tmp);
+
+	metrics_timeout_cb(&ucrun->metrics_timeout);
+
+	return;
+
+err:
+	unlink(tmp);
+	free(tmp);
+}
+
+void
+metrics_deinit(ucrun_ctx_t *ucrun)
+{
+	if (!ucrun->metrics)
+		return;
+
+	uloop_timeout_cancel(&ucrun->metrics_timeout);
+
+	/* a vanished segment tells collectors that the instance is gone */
+	if (ucrun->metrics_path) {
+		unlink(ucrun->metrics_path);
+		free(ucrun->metrics_path);
+		ucrun->metrics_path = NULL;
+	}
+
+	munmap(ucrun->metrics, sizeof(*ucrun->metrics));
+	ucrun->metrics = NULL;
+}
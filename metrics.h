@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2021 Jo-Philipp Wich <jo@mein.io>
+ * Copyright (C) 2021 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __UCRUN_METRICS_H
+#define __UCRUN_METRICS_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Layout of the shared metrics segment, collectors map the file read-only
+ * and include this header. Slots are only ever appended, the header count
+ * is bumped after a slot was fully initialized. Every slot is guarded by a
+ * sequence counter which is odd while the slot is being updated, readers
+ * retry until they saw the same even value before and after copying it.
+ */
+
+#define UCRUN_METRICS_MAGIC	0x55434d54	/* "UCMT" */
+#define UCRUN_METRICS_VERSION	1
+#define UCRUN_METRICS_SLOTS	256
+#define UCRUN_METRICS_NAME_LEN	48
+#define UCRUN_METRICS_BUCKETS	16
+
+enum {
+	UCRUN_METRIC_COUNTER = 1,
+	UCRUN_METRIC_GAUGE = 2,
+	UCRUN_METRIC_HISTOGRAM = 3,
+};
+
+struct ucrun_metrics_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;
+	uint32_t nslots;
+	uint32_t count;
+	uint32_t pad;
+};
+
+struct ucrun_metric {
+	uint32_t seq;
+	uint8_t type;
+	uint8_t nbuckets;
+	uint16_t pad;
+	char name[UCRUN_METRICS_NAME_LEN];
+
+	/* counter and gauge value, number of observations of a histogram */
+	int64_t value;
+
+	/* histogram only, the last bucket has no upper bound */
+	double sum;
+	double bounds[UCRUN_METRICS_BUCKETS - 1];
+	uint64_t buckets[UCRUN_METRICS_BUCKETS];
+};
+
+struct ucrun_metrics {
+	struct ucrun_metrics_hdr hdr;
+	struct ucrun_metric slots[UCRUN_METRICS_SLOTS];
+};
+
+/* take a consistent snapshot of a slot, for use by collectors */
+static inline void
+ucrun_metric_read(const struct ucrun_metric *src, struct ucrun_metric *dst)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1)
+			continue;
+
+		memcpy(dst, src, sizeof(*dst));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&src->seq, __ATOMIC_RELAXED) != seq);
+}
+
+#endif
@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2021 Jo-Philipp Wich <jo@mein.io>
+ * Copyright (C) 2021 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "ucrun.h"
+
+/*
+ * Samples are taken at instruction boundaries by the VM signal dispatch,
+ * which requires a ucode providing uc_vm_signal_raise(). The SIGPROF
+ * handler counts a tick and raises the signal in the VM, which calls
+ * profiler_tick() before executing the next instruction, so the recorded
+ * callframes are the ones the CPU time was spent in. Ticks taken while a
+ * native function runs are charged to the ucode frames calling it, ticks
+ * taken while no ucode code is running at all, e.g. inside libubus or the
+ * event loop, are counted as "[native]". Stacks are kept in collapsed form
+ * ("start;handler;helper") with their sample count.
+ */
+
+#define PROFILER_HZ		99
+#define PROFILER_MAX_STACKS	4096
+#define PROFILER_MAX_DEPTH	64
+#define PROFILER_NATIVE		"[native]"
+
+typedef struct {
+	struct avl_node avl;
+	uint64_t count;
+	char stack[];
+} profiler_stack_t;
+
+static volatile sig_atomic_t ticks;
+static volatile sig_atomic_t native;
+static int toggle_pipe[2] = { -1, -1 };
+static uc_vm_t *profiler_vm;
+
+static void
+profiler_sigprof(int signo)
+{
+	int err = errno;
+
+	/* without a callframe there is no ucode stack to charge */
+	if (!profiler_vm->callframes.count) {
+		native++;
+	}
+	else {
+		ticks++;
+		uc_vm_signal_raise(profiler_vm, SIGPROF);
+	}
+
+	errno = err;
+}
+
+static void
+profiler_sigusr2(int signo)
+{
+	int err = errno;
+
+	/* defer the toggle to the event loop */
+	if (write(toggle_pipe[1], "", 1) < 0) {}
+
+	errno = err;
+}
+
+static void
+profiler_count(ucrun_ctx_t *ucrun, const char *buf, size_t len, uint64_t count)
+{
+	profiler_stack_t *stack;
+
+	stack = avl_find_element(&ucrun->profiler_stacks, buf, stack, avl);
+
+	if (!stack) {
+		if (ucrun->profiler_stacks.count >= PROFILER_MAX_STACKS) {
+			ucrun->profiler_dropped += count;
+			return;
+		}
+
+		stack = calloc(1, sizeof(*stack) + len + 1);
+		if (!stack)
+			return;
+
+		memcpy(stack->stack, buf, len + 1);
+		stack->avl.key = stack->stack;
+		avl_insert(&ucrun->profiler_stacks, &stack->avl);
+	}
+
+	stack->count += count;
+}
+
+/* record the callframes below the given depth */
+static void
+profiler_record(uc_vm_t *vm, size_t depth, uint64_t count)
+{
+	uc_callframe_t *frame;
+	char buf[1024];
+	const char *name;
+	size_t i, len = 0;
+	int n;
+
+	i = (depth > PROFILER_MAX_DEPTH) ? depth - PROFILER_MAX_DEPTH : 0;
+
+	for (; i < depth; i++) {
+		frame = &vm->callframes.entries[i];
+
+		if (frame->cfunction)
+			name = frame->cfunction->name;
+		else if (frame->closure)
+			name = frame->closure->function->name;
+		else
+			continue;
+
+		n = snprintf(buf + len, sizeof(buf) - len, "%s%s",
+			     len ? ";" : "", *name ? name : "(anonymous)");
+
+		if (n < 0 || (size_t)n >= sizeof(buf) - len)
+			break;
+
+		len += n;
+	}
+
+	if (!len)
+		profiler_count(vm_to_ucrun(vm), PROFILER_NATIVE, strlen(PROFILER_NATIVE), count);
+	else
+		profiler_count(vm_to_ucrun(vm), buf, len, count);
+}
+
+static void
+profiler_flush(ucrun_ctx_t *ucrun)
+{
+	uint64_t pending = native;
+
+	if (pending) {
+		native = 0;
+		profiler_count(ucrun, PROFILER_NATIVE, strlen(PROFILER_NATIVE), pending);
+	}
+}
+
+/* SIGPROF handler of the VM, runs between two instructions */
+static uc_value_t *
+profiler_tick(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	uint64_t pending = ticks;
+
+	if (!ucrun->profiler_running || !pending)
+		return NULL;
+
+	ticks = 0;
+
+	/* skip the callframe of this function */
+	profiler_record(vm, vm->callframes.count - 1, pending);
+
+	return NULL;
+}
+
+/* ticks dispatched while the VM is idle, e.g. raised just before a call returned */
+static void
+profiler_signal_cb(struct uloop_fd *u, unsigned int events)
+{
+	ucrun_ctx_t *ucrun = container_of(u, ucrun_ctx_t, profiler_sig);
+	char buf[16];
+
+	while (read(u->fd, buf, sizeof(buf)) > 0)
+		;
+
+	uc_vm_signal_dispatch(&ucrun->vm);
+}
+
+static void
+profiler_halt(ucrun_ctx_t *ucrun)
+{
+	struct itimerval it = { 0 };
+
+	if (!ucrun->profiler_running)
+		return;
+
+	setitimer(ITIMER_PROF, &it, NULL);
+	signal(SIGPROF, SIG_IGN);
+
+	if (ucrun->profiler_sig.fd >= 0) {
+		uloop_fd_delete(&ucrun->profiler_sig);
+		ucrun->profiler_sig.fd = -1;
+	}
+
+	/* the handler stays installed, a tick still pending is ignored */
+	ucrun->profiler_running = false;
+	profiler_flush(ucrun);
+}
+
+static bool
+profiler_start(ucrun_ctx_t *ucrun, int hz)
+{
+	struct itimerval it = { 0 };
+	long usec;
+
+	if (ucrun->profiler_running || hz <= 0 || hz > 1000)
+		return false;
+
+	if (!ucv_array_set(ucrun->vm.signal.handler, SIGPROF,
+			   ucv_cfunction_new("profiler", profiler_tick))) {
+		fprintf(stderr, "Unable to install the profiling handler, "
+				"ucode lacks VM signal support\n");
+
+		return false;
+	}
+
+	/* the VM writes every raised signal to its notification pipe */
+	ucrun->profiler_sig.fd = uc_vm_signal_notifyfd(&ucrun->vm);
+	ucrun->profiler_sig.cb = profiler_signal_cb;
+
+	if (ucrun->profiler_sig.fd >= 0)
+		uloop_fd_add(&ucrun->profiler_sig, ULOOP_READ);
+
+	ticks = 0;
+	native = 0;
+	profiler_vm = &ucrun->vm;
+	signal(SIGPROF, profiler_sigprof);
+
+	usec = 1000000 / hz;
+	it.it_interval.tv_sec = usec / 1000000;
+	it.it_interval.tv_usec = usec % 1000000;
+	it.it_value = it.it_interval;
+
+	ucrun->profiler_running = true;
+
+	if (setitimer(ITIMER_PROF, &it, NULL)) {
+		fprintf(stderr, "Unable to start the profiling timer: %m\n");
+		profiler_halt(ucrun);
+
+		return false;
+	}
+
+	return true;
+}
+
+static void
+profiler_reset(ucrun_ctx_t *ucrun)
+{
+	profiler_stack_t *stack, *s;
+
+	avl_remove_all_elements(&ucrun->profiler_stacks, stack, avl, s)
+		free(stack);
+
+	ucrun->profiler_dropped = 0;
+}
+
+static void
+profiler_write(ucrun_ctx_t *ucrun, FILE *fp)
+{
+	profiler_stack_t *stack;
+
+	avl_for_each_element(&ucrun->profiler_stacks, stack, avl)
+		fprintf(fp, "%s %" PRIu64 "\n", stack->stack, stack->count);
+
+	if (ucrun->profiler_dropped)
+		fprintf(fp, "[dropped] %" PRIu64 "\n", ucrun->profiler_dropped);
+}
+
+static uc_value_t *
+profiler_collapsed(ucrun_ctx_t *ucrun)
+{
+	uc_value_t *rv;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &len);
+	if (!fp)
+		return NULL;
+
+	profiler_write(ucrun, fp);
+	fclose(fp);
+
+	rv = ucv_string_new_length(buf, len);
+	free(buf);
+
+	return rv;
+}
+
+static void
+profiler_toggle_cb(struct uloop_fd *u, unsigned int events)
+{
+	ucrun_ctx_t *ucrun = container_of(u, ucrun_ctx_t, profiler_fd);
+	char buf[16];
+	FILE *fp;
+
+	while (read(u->fd, buf, sizeof(buf)) > 0)
+		;
+
+	if (!ucrun->profiler_running) {
+		profiler_reset(ucrun);
+		profiler_start(ucrun, ucrun->profiler_hz);
+
+		return;
+	}
+
+	profiler_halt(ucrun);
+
+	fp = fopen(ucrun->profiler_path, "w");
+	if (!fp) {
+		fprintf(stderr, "Unable to write profile to %s: %m\n", ucrun->profiler_path);
+		return;
+	}
+
+	profiler_write(ucrun, fp);
+	fclose(fp);
+}
+
+static uc_value_t *
+uc_profiler_start(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	uc_value_t *hz = uc_fn_arg(0);
+
+	if (ucrun->profiler_running || (hz && ucv_type(hz) != UC_INTEGER))
+		return ucv_int64_new(-1);
+
+	profiler_reset(ucrun);
+
+	if (!profiler_start(ucrun, hz ? ucv_int64_get(hz) : ucrun->profiler_hz))
+		return ucv_int64_new(-1);
+
+	return ucv_int64_new(0);
+}
+
+static uc_value_t *
+uc_profiler_stop(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+
+	profiler_halt(ucrun);
+
+	return profiler_collapsed(ucrun);
+}
+
+static uc_value_t *
+uc_profiler_dump(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+
+	profiler_flush(ucrun);
+
+	return profiler_collapsed(ucrun);
+}
+
+void
+profiler_register(ucrun_ctx_t *ucrun)
+{
+	avl_init(&ucrun->profiler_stacks, avl_strcmp, false, NULL);
+	ucrun->profiler_hz = PROFILER_HZ;
+	ucrun->profiler_fd.fd = -1;
+	ucrun->profiler_sig.fd = -1;
+
+	uc_function_register(ucrun->scope, "profiler_start", uc_profiler_start);
+	uc_function_register(ucrun->scope, "profiler_stop", uc_profiler_stop);
+	uc_function_register(ucrun->scope, "profiler_dump", uc_profiler_dump);
+}
+
+void
+profiler_init(ucrun_ctx_t *ucrun, const char *path, int hz)
+{
+	ucrun->profiler_path = strdup(path);
+
+	if (hz > 0)
+		ucrun->profiler_hz = hz;
+
+	if (pipe(toggle_pipe))
+		return;
+
+	fcntl(toggle_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(toggle_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(toggle_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(toggle_pipe[1], F_SETFD, FD_CLOEXEC);
+
+	/* SIGUSR2 starts sampling, the next one writes the profile */
+	ucrun->profiler_fd.fd = toggle_pipe[0];
+	ucrun->profiler_fd.cb = profiler_toggle_cb;
+	uloop_fd_add(&ucrun->profiler_fd, ULOOP_READ);
+
+	signal(SIGUSR2, profiler_sigusr2);
+}
+
+void
+profiler_deinit(ucrun_ctx_t *ucrun)
+{
+	/* nothing to do if we bailed out before the functions were registered */
+	if (!ucrun->profiler_hz)
+		return;
+
+	profiler_halt(ucrun);
+	profiler_reset(ucrun);
+
+	if (ucrun->profiler_fd.fd >= 0) {
+		signal(SIGUSR2, SIG_DFL);
+		uloop_fd_delete(&ucrun->profiler_fd);
+		close(toggle_pipe[0]);
+		close(toggle_pipe[1]);
+		toggle_pipe[0] = toggle_pipe[1] = -1;
+		ucrun->profiler_fd.fd = -1;
+	}
+
+	free(ucrun->profiler_path);
+	ucrun->profiler_path = NULL;
+}
@@ -0,0 +1,803 @@
+/*
+ * Copyright (C) 2021 Jo-Philipp Wich <jo@mein.io>
+ * Copyright (C) 2021 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ucrun.h"
+
+/*
+ * The state file is an append log of set/delete records following a small
+ * file header. Records are 4 byte aligned and a record with a zero length
+ * marks the end of the log. A record that was only partially written when
+ * the process died fails its checksum and truncates the log at that point.
+ */
+
+#define STATE_MAGIC		"UCST"
+#define STATE_VERSION		1
+#define STATE_MIN_SIZE		(64 * 1024)
+#define STATE_COMPACT_MIN	(64 * 1024)
+#define STATE_COMPACT_DELAY	1000
+#define STATE_MAX_DEPTH		32
+
+enum {
+	STATE_OP_SET = 1,
+	STATE_OP_DELETE = 2,
+};
+
+enum {
+	STATE_T_NULL,
+	STATE_T_FALSE,
+	STATE_T_TRUE,
+	STATE_T_INT,
+	STATE_T_DOUBLE,
+	STATE_T_STRING,
+	STATE_T_ARRAY,
+	STATE_T_OBJECT,
+};
+
+struct state_hdr {
+	char magic[4];
+	uint32_t version;
+};
+
+struct state_rec {
+	uint32_t len;
+	uint32_t sum;
+	uint16_t klen;
+	uint8_t op;
+	uint8_t pad;
+};
+
+typedef struct {
+	struct avl_node avl;
+	size_t offset;
+	size_t length;
+	char key[];
+} state_entry_t;
+
+static struct {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+} buf;
+
+#define STATE_ALIGN(x)	(((x) + 3) & ~3)
+
+static uint32_t
+state_checksum(const struct state_rec *rec)
+{
+	const uint8_t *p = (const uint8_t *)(rec + 1);
+	uint32_t sum = 2166136261u;
+	size_t i;
+
+	sum = (sum ^ rec->klen) * 16777619u;
+	sum = (sum ^ rec->op) * 16777619u;
+
+	for (i = 0; i < rec->len; i++)
+		sum = (sum ^ p[i]) * 16777619u;
+
+	return sum;
+}
+
+static bool
+buf_put(const void *data, size_t len)
+{
+	if (buf.len + len > buf.size) {
+		size_t size = buf.size ? buf.size : 256;
+		uint8_t *tmp;
+
+		while (size < buf.len + len)
+			size *= 2;
+
+		tmp = realloc(buf.data, size);
+		if (!tmp)
+			return false;
+
+		buf.data = tmp;
+		buf.size = size;
+	}
+
+	memcpy(buf.data + buf.len, data, len);
+	buf.len += len;
+
+	return true;
+}
+
+static bool
+buf_put_type(uint8_t type)
+{
+	return buf_put(&type, sizeof(type));
+}
+
+static bool
+buf_put_string(const char *str, uint32_t len)
+{
+	return buf_put(&len, sizeof(len)) && buf_put(str, len) && buf_put("", 1);
+}
+
+static bool
+state_encode(uc_value_t *val, int depth)
+{
+	uint32_t count;
+	int64_t n;
+	double d;
+	size_t i;
+
+	if (depth > STATE_MAX_DEPTH)
+		return false;
+
+	switch (ucv_type(val)) {
+	case UC_NULL:
+		return buf_put_type(STATE_T_NULL);
+
+	case UC_BOOLEAN:
+		return buf_put_type(ucv_boolean_get(val) ? STATE_T_TRUE : STATE_T_FALSE);
+
+	case UC_INTEGER:
+		n = ucv_int64_get(val);
+
+		return buf_put_type(STATE_T_INT) && buf_put(&n, sizeof(n));
+
+	case UC_DOUBLE:
+		d = ucv_double_get(val);
+
+		return buf_put_type(STATE_T_DOUBLE) && buf_put(&d, sizeof(d));
+
+	case UC_STRING:
+		return buf_put_type(STATE_T_STRING) &&
+		       buf_put_string(ucv_string_get(val), ucv_string_length(val));
+
+	case UC_ARRAY:
+		count = ucv_array_length(val);
+
+		if (!buf_put_type(STATE_T_ARRAY) || !buf_put(&count, sizeof(count)))
+			return false;
+
+		for (i = 0; i < count; i++)
+			if (!state_encode(ucv_array_get(val, i), depth + 1))
+				return false;
+
+		return true;
+
+	case UC_OBJECT:
+		count = ucv_object_length(val);
+
+		if (!buf_put_type(STATE_T_OBJECT) || !buf_put(&count, sizeof(count)))
+			return false;
+
+		ucv_object_foreach(val, k, v)
+			if (!buf_put_string(k, strlen(k)) || !state_encode(v, depth + 1))
+				return false;
+
+		return true;
+
+	default:
+		/* functions, resources and regexps cannot be persisted */
+		return false;
+	}
+}
+
+static bool
+state_get_bytes(const uint8_t **p, const uint8_t *end, void *dst, size_t len)
+{
+	if ((size_t)(end - *p) < len)
+		return false;
+
+	memcpy(dst, *p, len);
+	*p += len;
+
+	return true;
+}
+
+static const char *
+state_get_string(const uint8_t **p, const uint8_t *end, uint32_t *len)
+{
+	const char *str;
+
+	if (!state_get_bytes(p, end, len, sizeof(*len)))
+		return NULL;
+
+	if ((size_t)(end - *p) <= *len || (*p)[*len] != 0)
+		return NULL;
+
+	str = (const char *)*p;
+	*p += *len + 1;
+
+	return str;
+}
+
+static uc_value_t *
+state_decode(uc_vm_t *vm, const uint8_t **p, const uint8_t *end, int depth, bool *ok)
+{
+	uc_value_t *val, *item;
+	const char *str;
+	uint32_t count, len, i;
+	uint8_t type;
+	int64_t n;
+	double d;
+
+	if (depth > STATE_MAX_DEPTH || !state_get_bytes(p, end, &type, sizeof(type)))
+		goto fail;
+
+	switch (type) {
+	case STATE_T_NULL:
+		return NULL;
+
+	case STATE_T_FALSE:
+	case STATE_T_TRUE:
+		return ucv_boolean_new(type == STATE_T_TRUE);
+
+	case STATE_T_INT:
+		if (!state_get_bytes(p, end, &n, sizeof(n)))
+			goto fail;
+
+		return ucv_int64_new(n);
+
+	case STATE_T_DOUBLE:
+		if (!state_get_bytes(p, end, &d, sizeof(d)))
+			goto fail;
+
+		return ucv_double_new(d);
+
+	case STATE_T_STRING:
+		str = state_get_string(p, end, &len);
+		if (!str)
+			goto fail;
+
+		return ucv_string_new_length(str, len);
+
+	case STATE_T_ARRAY:
+		if (!state_get_bytes(p, end, &count, sizeof(count)))
+			goto fail;
+
+		val = ucv_array_new(vm);
+
+		for (i = 0; i < count && *ok; i++)
+			ucv_array_push(val, state_decode(vm, p, end, depth + 1, ok));
+
+		return val;
+
+	case STATE_T_OBJECT:
+		if (!state_get_bytes(p, end, &count, sizeof(count)))
+			goto fail;
+
+		val = ucv_object_new(vm);
+
+		for (i = 0; i < count && *ok; i++) {
+			str = state_get_string(p, end, &len);
+			if (!str) {
+				*ok = false;
+				break;
+			}
+
+			item = state_decode(vm, p, end, depth + 1, ok);
+			ucv_object_add(val, str, item);
+		}
+
+		return val;
+	}
+
+fail:
+	*ok = false;
+
+	return NULL;
+}
+
+static struct state_rec *
+state_rec_at(ucrun_state_t *st, size_t offset)
+{
+	return (struct state_rec *)(st->map + offset);
+}
+
+static bool
+state_map(ucrun_state_t *st, size_t size)
+{
+	uint8_t *map;
+
+	if (ftruncate(st->fd, size))
+		return false;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, st->fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+
+	if (st->map)
+		munmap(st->map, st->size);
+
+	st->map = map;
+	st->size = size;
+
+	return true;
+}
+
+static bool
+state_reserve(ucrun_state_t *st, size_t len)
+{
+	size_t size = st->size;
+
+	/* always keep room for the zero length end marker */
+	len += sizeof(uint32_t);
+
+	if (st->used + len <= st->size)
+		return true;
+
+	while (size < st->used + len)
+		size *= 2;
+
+	return state_map(st, size);
+}
+
+static void
+state_entry_free(ucrun_state_t *st, state_entry_t *entry)
+{
+	avl_delete(&st->index, &entry->avl);
+	st->live -= entry->length;
+	free(entry);
+}
+
+static void
+state_index(ucrun_state_t *st, const char *key, size_t offset, size_t length)
+{
+	state_entry_t *entry = avl_find_element(&st->index, key, entry, avl);
+
+	if (entry) {
+		st->live += length - entry->length;
+		entry->offset = offset;
+		entry->length = length;
+
+		return;
+	}
+
+	entry = calloc(1, sizeof(*entry) + strlen(key) + 1);
+	if (!entry)
+		return;
+
+	strcpy(entry->key, key);
+	entry->avl.key = entry->key;
+	entry->offset = offset;
+	entry->length = length;
+	avl_insert(&st->index, &entry->avl);
+	st->live += length;
+}
+
+static void
+state_compact(ucrun_state_t *st)
+{
+	ucrun_state_t tmp = { .fd = -1 };
+	state_entry_t *entry;
+	size_t size = STATE_MIN_SIZE, offset;
+	char *path;
+
+	path = malloc(strlen(st->path) + sizeof(".tmp"));
+	if (!path)
+		return;
+
+	sprintf(path, "%s.tmp", st->path);
+
+	while (size < 2 * (sizeof(struct state_hdr) + st->live))
+		size *= 2;
+
+	tmp.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (tmp.fd < 0 || !state_map(&tmp, size))
+		goto out;
+
+	/* copy the live records over, they are already encoded */
+	memcpy(tmp.map, st->map, sizeof(struct state_hdr));
+	tmp.used = sizeof(struct state_hdr);
+
+	avl_for_each_element(&st->index, entry, avl) {
+		memcpy(tmp.map + tmp.used, st->map + entry->offset, entry->length);
+		tmp.used += entry->length;
+	}
+
+	if (rename(path, st->path))
+		goto out;
+
+	/* only move the index over once the new file is in place */
+	offset = sizeof(struct state_hdr);
+
+	avl_for_each_element(&st->index, entry, avl) {
+		entry->offset = offset;
+		offset += entry->length;
+	}
+
+	munmap(st->map, st->size);
+	close(st->fd);
+
+	st->fd = tmp.fd;
+	st->map = tmp.map;
+	st->size = tmp.size;
+	st->used = tmp.used;
+	free(path);
+
+	return;
+
+out:
+	fprintf(stderr, "Failed to compact state file %s: %m\n", st->path);
+
+	if (tmp.map)
+		munmap(tmp.map, tmp.size);
+
+	if (tmp.fd >= 0) {
+		close(tmp.fd);
+		unlink(path);
+	}
+
+	free(path);
+}
+
+static void
+state_compact_cb(struct uloop_timeout *t)
+{
+	ucrun_state_t *st = container_of(t, ucrun_state_t, compact);
+
+	state_compact(st);
+}
+
+static void
+state_compact_schedule(ucrun_state_t *st)
+{
+	size_t garbage = st->used - sizeof(struct state_hdr) - st->live;
+
+	if (garbage < STATE_COMPACT_MIN || garbage < st->live)
+		return;
+
+	if (!st->compact.pending)
+		uloop_timeout_set(&st->compact, STATE_COMPACT_DELAY);
+}
+
+static bool
+state_append(ucrun_state_t *st, uint8_t op, const char *key, const void *data, size_t len)
+{
+	size_t klen = strlen(key), total;
+	struct state_rec *rec;
+	uint8_t *p;
+
+	if (klen > UINT16_MAX)
+		return false;
+
+	total = STATE_ALIGN(sizeof(*rec) + klen + 1 + len);
+
+	if (!state_reserve(st, total))
+		return false;
+
+	rec = state_rec_at(st, st->used);
+	p = (uint8_t *)(rec + 1);
+
+	memcpy(p, key, klen + 1);
+	memcpy(p + klen + 1, data, len);
+
+	rec->klen = klen;
+	rec->op = op;
+	rec->pad = 0;
+
+	/*
+	 * Stores into the mapping may reach the file in any order, a torn
+	 * record is detected by its checksum on replay and ends the log there.
+	 */
+	rec->len = klen + 1 + len;
+	rec->sum = state_checksum(rec);
+
+	if (op == STATE_OP_SET)
+		state_index(st, key, st->used, total);
+
+	st->used += total;
+	state_compact_schedule(st);
+
+	return true;
+}
+
+static void
+state_replay(ucrun_state_t *st)
+{
+	size_t offset = sizeof(struct state_hdr), total;
+	state_entry_t *entry;
+	struct state_rec *rec;
+	const char *key;
+
+	while (offset + sizeof(*rec) <= st->size) {
+		rec = state_rec_at(st, offset);
+
+		if (!rec->len)
+			break;
+
+		total = STATE_ALIGN(sizeof(*rec) + rec->len);
+
+		if (total > st->size - offset || rec->klen >= rec->len)
+			break;
+
+		/* the checksum does not cover the sum itself, verify without writing */
+		if (state_checksum(rec) != rec->sum)
+			break;
+
+		key = (const char *)(rec + 1);
+
+		if (key[rec->klen] != 0)
+			break;
+
+		if (rec->op == STATE_OP_SET) {
+			state_index(st, key, offset, total);
+		}
+		else if (rec->op == STATE_OP_DELETE) {
+			entry = avl_find_element(&st->index, key, entry, avl);
+
+			if (entry)
+				state_entry_free(st, entry);
+		}
+
+		offset += total;
+	}
+
+	/* drop whatever follows the last valid record */
+	st->used = offset;
+	memset(st->map + offset, 0, st->size - offset);
+}
+
+static bool
+state_open(ucrun_state_t *st)
+{
+	struct state_hdr *hdr;
+	struct stat s;
+	size_t size = STATE_MIN_SIZE;
+
+	st->fd = open(st->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (st->fd < 0)
+		return false;
+
+	if (fstat(st->fd, &s))
+		return false;
+
+	while (size < (size_t)s.st_size)
+		size *= 2;
+
+	if (!state_map(st, size))
+		return false;
+
+	hdr = (struct state_hdr *)st->map;
+
+	/* start over if the file is new or was written by someone else */
+	if (memcmp(hdr->magic, STATE_MAGIC, sizeof(hdr->magic)) || hdr->version != STATE_VERSION) {
+		memset(st->map, 0, st->size);
+		memcpy(hdr->magic, STATE_MAGIC, sizeof(hdr->magic));
+		hdr->version = STATE_VERSION;
+	}
+
+	state_replay(st);
+	state_compact_schedule(st);
+
+	return true;
+}
+
+static uc_value_t *
+state_entry_value(uc_vm_t *vm, ucrun_state_t *st, state_entry_t *entry)
+{
+	struct state_rec *rec = state_rec_at(st, entry->offset);
+	const uint8_t *p = (const uint8_t *)(rec + 1) + rec->klen + 1;
+	const uint8_t *end = (const uint8_t *)(rec + 1) + rec->len;
+	uc_value_t *val;
+	bool ok = true;
+
+	val = state_decode(vm, &p, end, 0, &ok);
+
+	if (!ok) {
+		ucv_put(val);
+
+		return NULL;
+	}
+
+	return val;
+}
+
+static ucrun_state_t *
+vm_to_state(uc_vm_t *vm)
+{
+	ucrun_state_t *st = &vm_to_ucrun(vm)->state;
+
+	return st->map ? st : NULL;
+}
+
+static uc_value_t *
+uc_state_get(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_state_t *st = vm_to_state(vm);
+	uc_value_t *key = uc_fn_arg(0);
+	state_entry_t *entry;
+
+	if (!st || ucv_type(key) != UC_STRING)
+		return NULL;
+
+	entry = avl_find_element(&st->index, ucv_string_get(key), entry, avl);
+	if (!entry || !memory_guard(vm))
+		return NULL;
+
+	return state_entry_value(vm, st, entry);
+}
+
+static uc_value_t *
+uc_state_set(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_state_t *st = vm_to_state(vm);
+	uc_value_t *key = uc_fn_arg(0);
+	uc_value_t *val = uc_fn_arg(1);
+	state_entry_t *entry;
+	struct state_rec *rec;
+	const char *k;
+
+	if (!st || ucv_type(key) != UC_STRING)
+		return ucv_int64_new(-1);
+
+	buf.len = 0;
+
+	if (!state_encode(val, 0))
+		return ucv_int64_new(-1);
+
+	k = ucv_string_get(key);
+
+	/* avoid growing the log when the value did not change */
+	entry = avl_find_element(&st->index, k, entry, avl);
+
+	if (entry) {
+		rec = state_rec_at(st, entry->offset);
+
+		if (rec->len - rec->klen - 1 == buf.len &&
+		    !memcmp((uint8_t *)(rec + 1) + rec->klen + 1, buf.data, buf.len))
+			return ucv_int64_new(0);
+	}
+
+	if (!state_append(st, STATE_OP_SET, k, buf.data, buf.len))
+		return ucv_int64_new(-1);
+
+	return ucv_int64_new(0);
+}
+
+static uc_value_t *
+uc_state_delete(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_state_t *st = vm_to_state(vm);
+	uc_value_t *key = uc_fn_arg(0);
+	state_entry_t *entry;
+
+	if (!st || ucv_type(key) != UC_STRING)
+		return ucv_int64_new(-1);
+
+	entry = avl_find_element(&st->index, ucv_string_get(key), entry, avl);
+	if (!entry)
+		return ucv_int64_new(-1);
+
+	if (!state_append(st, STATE_OP_DELETE, entry->key, NULL, 0))
+		return ucv_int64_new(-1);
+
+	state_entry_free(st, entry);
+
+	return ucv_int64_new(0);
+}
+
+static uc_value_t *
+uc_state_iterate(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_state_t *st = vm_to_state(vm);
+	uc_value_t *function = uc_fn_arg(0);
+	uc_value_t *keys, *key, *retval;
+	state_entry_t *entry;
+	size_t i, n = 0;
+	bool stop;
+
+	if (!st || !ucv_is_callable(function))
+		return ucv_int64_new(-1);
+
+	if (!memory_guard(vm))
+		return NULL;
+
+	/* snapshot the keys, the callback is free to modify the store */
+	keys = ucv_array_new(vm);
+
+	avl_for_each_element(&st->index, entry, avl)
+		ucv_array_push(keys, ucv_string_new(entry->key));
+
+	for (i = 0; i < ucv_array_length(keys); i++) {
+		key = ucv_array_get(keys, i);
+		entry = avl_find_element(&st->index, ucv_string_get(key), entry, avl);
+
+		if (!entry)
+			continue;
+
+		/* push the function, key and value to the stack */
+		uc_vm_stack_push(vm, ucv_get(function));
+		uc_vm_stack_push(vm, ucv_get(key));
+		uc_vm_stack_push(vm, state_entry_value(vm, st, entry));
+
+		if (uc_vm_call(vm, false, 2)) {
+			/* function raised an exception, let it propagate */
+			ucv_put(keys);
+
+			return NULL;
+		}
+
+		retval = uc_vm_stack_pop(vm);
+		stop = (ucv_type(retval) == UC_BOOLEAN && !ucv_boolean_get(retval));
+		ucv_put(retval);
+		n++;
+
+		/* returning false stops the iteration */
+		if (stop)
+			break;
+	}
+
+	ucv_put(keys);
+
+	return ucv_int64_new(n);
+}
+
+void
+state_register(ucrun_ctx_t *ucrun)
+{
+	uc_function_register(ucrun->scope, "state_get", uc_state_get);
+	uc_function_register(ucrun->scope, "state_set", uc_state_set);
+	uc_function_register(ucrun->scope, "state_delete", uc_state_delete);
+	uc_function_register(ucrun->scope, "state_iterate", uc_state_iterate);
+}
+
+void
+state_init(ucrun_ctx_t *ucrun, const char *path)
+{
+	ucrun_state_t *st = &ucrun->state;
+
+	avl_init(&st->index, avl_strcmp, false, NULL);
+	st->fd = -1;
+	st->compact.cb = state_compact_cb;
+	st->path = strdup(path);
+
+	if (!state_open(st)) {
+		fprintf(stderr, "Unable to open state file %s: %m\n", path);
+		state_deinit(ucrun);
+	}
+}
+
+void
+state_deinit(ucrun_ctx_t *ucrun)
+{
+	ucrun_state_t *st = &ucrun->state;
+	state_entry_t *entry, *e;
+
+	if (!st->path)
+		return;
+
+	/* leave a compact file behind for the next start */
+	uloop_timeout_cancel(&st->compact);
+
+	if (st->map && st->used - sizeof(struct state_hdr) > st->live)
+		state_compact(st);
+
+	avl_remove_all_elements(&st->index, entry, avl, e)
+		free(entry);
+
+	if (st->map)
+		munmap(st->map, st->size);
+
+	if (st->fd >= 0)
+		close(st->fd);
+
+	free(st->path);
+	free(buf.data);
+
+	memset(st, 0, sizeof(*st));
+	buf.data = NULL;
+	buf.len = buf.size = 0;
+}
@@ -0,0 +1,458 @@
+/*
+ * Copyright (C) 2021 Jo-Philipp Wich <jo@mein.io>
+ * Copyright (C) 2021 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libubox/usock.h>
+
+#include "ucrun.h"
+
+static uc_resource_type_t *stream_type, *server_type;
+
+static void
+stream_call(ucrun_stream_t *stream, const char *name, uc_value_t *arg)
+{
+	uc_vm_t *vm = &stream->ucrun->vm;
+	uc_value_t *function = ucv_object_get(stream->handlers, name, NULL);
+
+	if (!ucv_is_callable(function)) {
+		ucv_put(arg);
+		return;
+	}
+
+	/* push the function, the connection and the argument to the stack */
+	uc_vm_stack_push(vm, ucv_get(function));
+	uc_vm_stack_push(vm, ucv_get(stream->res));
+
+	if (arg)
+		uc_vm_stack_push(vm, arg);
+
+	/* execute the callback */
+	if (!uc_vm_call(vm, false, arg ? 2 : 1))
+		ucv_put(uc_vm_stack_pop(vm));
+}
+
+static void
+stream_free(ucrun_stream_t *stream)
+{
+	void **dataptr = ucv_resource_dataptr(stream->res, "ucrun.stream");
+
+	/* detach the script handle, it may outlive the connection */
+	if (dataptr)
+		*dataptr = NULL;
+
+	uloop_timeout_cancel(&stream->free);
+	ustream_free(&stream->stream.stream);
+	close(stream->stream.fd.fd);
+
+	ucv_put(stream->res);
+	ucv_put(stream->handlers);
+	list_del(&stream->list);
+	free(stream->linebuf);
+	free(stream);
+}
+
+static void
+stream_free_cb(struct uloop_timeout *t)
+{
+	ucrun_stream_t *stream = container_of(t, ucrun_stream_t, free);
+
+	stream_free(stream);
+}
+
+static void
+stream_close(ucrun_stream_t *stream)
+{
+	if (stream->closed)
+		return;
+
+	stream->closed = true;
+
+	/* tell the user code, the connection is released once we unwound */
+	stream_call(stream, "close", NULL);
+	uloop_timeout_set(&stream->free, 0);
+}
+
+static bool
+stream_line_append(ucrun_stream_t *stream, const char *data, size_t len)
+{
+	char *buf;
+
+	if (stream->linelen + len > UCRUN_STREAM_LINE_MAX)
+		return false;
+
+	buf = realloc(stream->linebuf, stream->linelen + len);
+	if (!buf)
+		return false;
+
+	memcpy(buf + stream->linelen, data, len);
+	stream->linebuf = buf;
+	stream->linelen += len;
+
+	return true;
+}
+
+static void
+stream_line_flush(ucrun_stream_t *stream)
+{
+	uc_value_t *line = ucv_string_new_length(stream->linebuf, stream->linelen);
+
+	stream->linelen = 0;
+	stream_call(stream, "data", line);
+}
+
+static void
+stream_notify_read(struct ustream *s, int bytes)
+{
+	ucrun_stream_t *stream = container_of(s, ucrun_stream_t, stream.stream);
+	char *buf, *nl;
+	int len, chunk;
+
+	while (!stream->closed) {
+		buf = ustream_get_read_buf(s, &len);
+
+		if (!buf || !len)
+			break;
+
+		if (!stream->line) {
+			stream_call(stream, "data", ucv_string_new_length(buf, len));
+
+			if (!stream->closed)
+				ustream_consume(s, len);
+
+			continue;
+		}
+
+		nl = memchr(buf, '\n', len);
+		chunk = nl ? nl - buf : len;
+
+		/* complete lines within the read buffer are handed out directly */
+		if (nl && !stream->linelen) {
+			uc_value_t *line = ucv_string_new_length(buf, chunk);
+
+			ustream_consume(s, chunk + 1);
+			stream_call(stream, "data", line);
+
+			continue;
+		}
+
+		/* lines spanning read buffers are collected, up to a limit */
+		if (!stream_line_append(stream, buf, chunk)) {
+			fprintf(stderr, "Stream line exceeds %d bytes - closing connection.\n",
+				UCRUN_STREAM_LINE_MAX);
+			stream_close(stream);
+
+			return;
+		}
+
+		ustream_consume(s, nl ? chunk + 1 : chunk);
+
+		if (nl)
+			stream_line_flush(stream);
+	}
+
+	/* an unterminated last line is delivered on EOF */
+	if (s->eof && stream->linelen && !stream->closed)
+		stream_line_flush(stream);
+}
+
+static void
+stream_notify_state(struct ustream *s)
+{
+	ucrun_stream_t *stream = container_of(s, ucrun_stream_t, stream.stream);
+
+	/* deliver the trailing data of a line mode stream before closing */
+	if (s->eof)
+		stream_notify_read(s, 0);
+
+	if (s->eof || s->write_error)
+		stream_close(stream);
+}
+
+static ucrun_stream_t *
+stream_new(ucrun_ctx_t *ucrun, int fd, uc_value_t *handlers)
+{
+	ucrun_stream_t *stream = calloc(1, sizeof(*stream));
+
+	if (!stream) {
+		close(fd);
+
+		return NULL;
+	}
+
+	stream->ucrun = ucrun;
+	stream->handlers = ucv_get(handlers);
+	stream->line = ucv_is_truish(ucv_object_get(handlers, "line", NULL));
+	stream->res = ucv_resource_new(stream_type, stream);
+	stream->free.cb = stream_free_cb;
+	stream->stream.stream.notify_read = stream_notify_read;
+	stream->stream.stream.notify_state = stream_notify_state;
+	ustream_fd_init(&stream->stream, fd);
+
+	/* track the stream in our context */
+	list_add(&stream->list, &ucrun->stream);
+
+	return stream;
+}
+
+static void
+server_free(ucrun_server_t *server)
+{
+	void **dataptr = ucv_resource_dataptr(server->res, "ucrun.server");
+
+	if (dataptr)
+		*dataptr = NULL;
+
+	uloop_timeout_cancel(&server->free);
+	uloop_fd_delete(&server->fd);
+	close(server->fd.fd);
+
+	ucv_put(server->res);
+	ucv_put(server->handlers);
+	list_del(&server->list);
+	free(server);
+}
+
+static void
+server_free_cb(struct uloop_timeout *t)
+{
+	ucrun_server_t *server = container_of(t, ucrun_server_t, free);
+
+	server_free(server);
+}
+
+static void
+server_accept_cb(struct uloop_fd *u, unsigned int events)
+{
+	ucrun_server_t *server = container_of(u, ucrun_server_t, fd);
+	ucrun_stream_t *stream;
+	uc_value_t *function;
+	uc_vm_t *vm;
+	int fd;
+
+	while (true) {
+		fd = accept(u->fd, NULL, NULL);
+
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+
+		stream = stream_new(server->ucrun, fd, server->handlers);
+		if (!stream)
+			continue;
+
+		function = ucv_object_get(server->handlers, "accept", NULL);
+		if (!ucv_is_callable(function))
+			continue;
+
+		/* hand the new connection to the user code */
+		vm = &server->ucrun->vm;
+		uc_vm_stack_push(vm, ucv_get(function));
+		uc_vm_stack_push(vm, ucv_get(stream->res));
+
+		if (!uc_vm_call(vm, false, 1))
+			ucv_put(uc_vm_stack_pop(vm));
+
+		/* the callback might have closed the server */
+		if (server->closed)
+			break;
+	}
+}
+
+static int
+stream_socket(uc_value_t *target, int type)
+{
+	uc_value_t *path = ucv_object_get(target, "path", NULL);
+	uc_value_t *host = ucv_object_get(target, "host", NULL);
+	uc_value_t *port = ucv_object_get(target, "port", NULL);
+	char service[sizeof("65535")];
+	struct stat s;
+
+	if (ucv_type(path) == UC_STRING) {
+		/* remove stale sockets left behind by a previous instance, but nothing else */
+		if ((type & USOCK_SERVER) && !lstat(ucv_string_get(path), &s) && S_ISSOCK(s.st_mode))
+			unlink(ucv_string_get(path));
+
+		return usock(type | USOCK_UNIX, ucv_string_get(path), NULL);
+	}
+
+	if (ucv_type(port) != UC_INTEGER ||
+	    ucv_int64_get(port) < 1 || ucv_int64_get(port) > 65535)
+		return -1;
+
+	snprintf(service, sizeof(service), "%u", (unsigned int)ucv_int64_get(port));
+
+	return usock(type | USOCK_TCP,
+		     ucv_type(host) == UC_STRING ? ucv_string_get(host) : NULL, service);
+}
+
+static uc_value_t *
+uc_ustream_connect(uc_vm_t *vm, size_t nargs)
+{
+	uc_value_t *target = uc_fn_arg(0);
+	uc_value_t *handlers = uc_fn_arg(1);
+	ucrun_stream_t *stream;
+	int fd;
+
+	/* check if the call signature is correct */
+	if (ucv_type(target) != UC_OBJECT || ucv_type(handlers) != UC_OBJECT)
+		return NULL;
+
+	fd = stream_socket(target, USOCK_NONBLOCK);
+	if (fd < 0)
+		return NULL;
+
+	stream = stream_new(vm_to_ucrun(vm), fd, handlers);
+	if (!stream)
+		return NULL;
+
+	return ucv_get(stream->res);
+}
+
+static uc_value_t *
+uc_ustream_listen(uc_vm_t *vm, size_t nargs)
+{
+	uc_value_t *target = uc_fn_arg(0);
+	uc_value_t *handlers = uc_fn_arg(1);
+	ucrun_server_t *server;
+	int fd;
+
+	/* check if the call signature is correct */
+	if (ucv_type(target) != UC_OBJECT || ucv_type(handlers) != UC_OBJECT)
+		return NULL;
+
+	fd = stream_socket(target, USOCK_SERVER | USOCK_NONBLOCK);
+	if (fd < 0)
+		return NULL;
+
+	server = calloc(1, sizeof(*server));
+	if (!server) {
+		close(fd);
+
+		return NULL;
+	}
+
+	server->ucrun = vm_to_ucrun(vm);
+	server->handlers = ucv_get(handlers);
+	server->res = ucv_resource_new(server_type, server);
+	server->fd.fd = fd;
+	server->fd.cb = server_accept_cb;
+	server->free.cb = server_free_cb;
+	uloop_fd_add(&server->fd, ULOOP_READ);
+
+	/* track the server in our context */
+	list_add(&server->list, &server->ucrun->server);
+
+	return ucv_get(server->res);
+}
+
+static uc_value_t *
+uc_stream_write(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_stream_t **stream = (ucrun_stream_t **)uc_fn_this("ucrun.stream");
+	uc_value_t *data = uc_fn_arg(0);
+
+	if (!stream || !*stream || (*stream)->closed || ucv_type(data) != UC_STRING)
+		return ucv_int64_new(-1);
+
+	/* ustream buffers whatever the socket does not take right now */
+	return ucv_int64_new(ustream_write(&(*stream)->stream.stream,
+					   ucv_string_get(data), ucv_string_length(data), false));
+}
+
+static uc_value_t *
+uc_stream_pending(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_stream_t **stream = (ucrun_stream_t **)uc_fn_this("ucrun.stream");
+
+	if (!stream || !*stream || (*stream)->closed)
+		return ucv_int64_new(-1);
+
+	return ucv_int64_new(ustream_pending_data(&(*stream)->stream.stream, true));
+}
+
+static uc_value_t *
+uc_stream_close(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_stream_t **stream = (ucrun_stream_t **)uc_fn_this("ucrun.stream");
+
+	if (!stream || !*stream)
+		return ucv_int64_new(-1);
+
+	stream_close(*stream);
+
+	return ucv_int64_new(0);
+}
+
+static uc_value_t *
+uc_server_close(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_server_t **server = (ucrun_server_t **)uc_fn_this("ucrun.server");
+
+	if (!server || !*server || (*server)->closed)
+		return ucv_int64_new(-1);
+
+	/* stop accepting right away, release the server once we unwound */
+	(*server)->closed = true;
+	uloop_fd_delete(&(*server)->fd);
+	uloop_timeout_set(&(*server)->free, 0);
+
+	return ucv_int64_new(0);
+}
+
+static const uc_function_list_t stream_fns[] = {
+	{ "write",	uc_stream_write },
+	{ "pending",	uc_stream_pending },
+	{ "close",	uc_stream_close },
+};
+
+static const uc_function_list_t server_fns[] = {
+	{ "close",	uc_server_close },
+};
+
+void
+stream_register(ucrun_ctx_t *ucrun)
+{
+	stream_type = uc_type_declare(&ucrun->vm, "ucrun.stream", stream_fns, NULL);
+	server_type = uc_type_declare(&ucrun->vm, "ucrun.server", server_fns, NULL);
+
+	uc_function_register(ucrun->scope, "ustream_connect", uc_ustream_connect);
+	uc_function_register(ucrun->scope, "ustream_listen", uc_ustream_listen);
+}
+
+void
+stream_deinit(ucrun_ctx_t *ucrun)
+{
+	ucrun_stream_t *stream, *s;
+	ucrun_server_t *server, *p;
+
+	list_for_each_entry_safe(server, p, &ucrun->server, list)
+		server_free(server);
+
+	list_for_each_entry_safe(stream, s, &ucrun->stream, list)
+		stream_free(stream);
+}
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2021 Jo-Philipp Wich <jo@mein.io>
+ * Copyright (C) 2021 John Crispin <john@phrozen.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <time.h>
+
+#include "ucrun.h"
+
+/*
+ * Tasks are run in slices from a zero delay uloop timeout, so pending
+ * fd events and timers get dispatched between two slices. Each slice
+ * calls the task function until it either reports completion or the
+ * slice budget is used up. The highest priority task runs first, tasks
+ * of equal priority take turns.
+ */
+
+#define TASK_SLICE_MS	5
+
+static uint64_t
+task_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+task_free(ucrun_task_t *task)
+{
+	ucv_put(task->function);
+	ucv_put(task->priv);
+	ucv_put(task->done);
+	list_del(&task->list);
+	free(task);
+}
+
+static ucrun_task_t *
+task_next(ucrun_ctx_t *ucrun)
+{
+	ucrun_task_t *task, *next = NULL;
+
+	list_for_each_entry(task, &ucrun->task, list)
+		if (!next || task->priority > next->priority)
+			next = task;
+
+	return next;
+}
+
+static void
+task_done(ucrun_task_t *task)
+{
+	uc_vm_t *vm = &task->ucrun->vm;
+
+	if (!ucv_is_callable(task->done))
+		return;
+
+	/* push the function and private data to the stack */
+	uc_vm_stack_push(vm, ucv_get(task->done));
+	uc_vm_stack_push(vm, ucv_get(task->priv));
+
+	if (!uc_vm_call(vm, false, 1))
+		ucv_put(uc_vm_stack_pop(vm));
+}
+
+static void
+task_slice_cb(struct uloop_timeout *t)
+{
+	ucrun_ctx_t *ucrun = container_of(t, ucrun_ctx_t, task_timeout);
+	ucrun_task_t *task = task_next(ucrun);
+	uint64_t start, now;
+	uc_value_t *retval;
+	bool finished = false;
+
+	if (!task)
+		return;
+
+	ucrun->task_running = task;
+	start = now = task_now();
+
+	while (now - start < task->slice) {
+		/* push the function and private data to the stack */
+		uc_vm_stack_push(&ucrun->vm, ucv_get(task->function));
+		uc_vm_stack_push(&ucrun->vm, ucv_get(task->priv));
+
+		task->calls++;
+
+		/* a task that raised an exception is dropped */
+		if (uc_vm_call(&ucrun->vm, false, 1)) {
+			task->cancelled = true;
+			break;
+		}
+
+		/* the task keeps running for as long as it returns a true value */
+		retval = uc_vm_stack_pop(&ucrun->vm);
+		finished = !ucv_is_truish(retval);
+		ucv_put(retval);
+
+		now = task_now();
+
+		if (finished || task->cancelled)
+			break;
+	}
+
+	now = task_now();
+	task->slices++;
+	task->time += now - start;
+	ucrun->task_slices++;
+	ucrun->task_time += now - start;
+
+	/* done() may cancel its own task, keep it marked running until it returned */
+	if (finished && !task->cancelled)
+		task_done(task);
+
+	ucrun->task_running = NULL;
+
+	if (finished || task->cancelled)
+		task_free(task);
+	else
+		list_move_tail(&task->list, &ucrun->task);
+
+	/* yield to the event loop, the next slice runs on the next iteration */
+	if (!list_empty(&ucrun->task))
+		uloop_timeout_set(&ucrun->task_timeout, 0);
+}
+
+static uc_value_t *
+uc_task(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	ucrun_task_t *task;
+
+	uc_value_t *function = uc_fn_arg(0);
+	uc_value_t *priv = uc_fn_arg(1);
+	uc_value_t *opts = uc_fn_arg(2);
+	uc_value_t *priority = ucv_object_get(opts, "priority", NULL);
+	uc_value_t *slice = ucv_object_get(opts, "slice_ms", NULL);
+	uc_value_t *done = ucv_object_get(opts, "done", NULL);
+
+	/* check if the call signature is correct */
+	if (!ucv_is_callable(function) || (opts && ucv_type(opts) != UC_OBJECT) ||
+	    (priority && ucv_type(priority) != UC_INTEGER) ||
+	    (slice && (ucv_type(slice) != UC_INTEGER || ucv_int64_get(slice) <= 0)))
+		return ucv_int64_new(-1);
+
+	if (!memory_guard(vm))
+		return NULL;
+
+	/* add the task */
+	task = calloc(1, sizeof(*task));
+	task->ucrun = ucrun;
+	task->id = ++ucrun->task_id;
+	task->function = ucv_get(function);
+	task->priv = ucv_get(priv);
+	task->done = ucv_get(done);
+	task->priority = priority ? ucv_int64_get(priority) : 0;
+	task->slice = (slice ? ucv_int64_get(slice) : TASK_SLICE_MS) * 1000;
+
+	/* track the task in our context */
+	list_add_tail(&task->list, &ucrun->task);
+
+	if (!ucrun->task_timeout.pending && !ucrun->task_running)
+		uloop_timeout_set(&ucrun->task_timeout, 0);
+
+	return ucv_int64_new(task->id);
+}
+
+static uc_value_t *
+uc_task_cancel(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	uc_value_t *id = uc_fn_arg(0);
+	ucrun_task_t *task;
+
+	if (ucv_type(id) != UC_INTEGER)
+		return ucv_int64_new(-1);
+
+	list_for_each_entry(task, &ucrun->task, list) {
+		if (task->id != ucv_int64_get(id) || task->cancelled)
+			continue;
+
+		/* a task cancelling itself is released once its call returned */
+		if (task == ucrun->task_running)
+			task->cancelled = true;
+		else
+			task_free(task);
+
+		return ucv_int64_new(0);
+	}
+
+	return ucv_int64_new(-1);
+}
+
+static uc_value_t *
+uc_task_stats(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	uc_value_t *stats = ucv_object_new(vm);
+	uc_value_t *tasks = ucv_array_new(vm), *stat;
+	ucrun_task_t *task;
+
+	list_for_each_entry(task, &ucrun->task, list) {
+		stat = ucv_object_new(vm);
+		ucv_object_add(stat, "id", ucv_int64_new(task->id));
+		ucv_object_add(stat, "priority", ucv_int64_new(task->priority));
+		ucv_object_add(stat, "slices", ucv_uint64_new(task->slices));
+		ucv_object_add(stat, "calls", ucv_uint64_new(task->calls));
+		ucv_object_add(stat, "time_us", ucv_uint64_new(task->time));
+		ucv_array_push(tasks, stat);
+	}
+
+	ucv_object_add(stats, "slices", ucv_uint64_new(ucrun->task_slices));
+	ucv_object_add(stats, "time_us", ucv_uint64_new(ucrun->task_time));
+	ucv_object_add(stats, "tasks", tasks);
+
+	return stats;
+}
+
+void
+task_register(ucrun_ctx_t *ucrun)
+{
+	ucrun->task_timeout.cb = task_slice_cb;
+
+	uc_function_register(ucrun->scope, "task", uc_task);
+	uc_function_register(ucrun->scope, "task_cancel", uc_task_cancel);
+	uc_function_register(ucrun->scope, "task_stats", uc_task_stats);
+}
+
+void
+task_deinit(ucrun_ctx_t *ucrun)
+{
+	ucrun_task_t *task, *t;
+
+	uloop_timeout_cancel(&ucrun->task_timeout);
+
+	list_for_each_entry_safe(task, t, &ucrun->task, list)
+		task_free(task);
+}
@@ -22,6 +22,31 @@ global.ulog = {
 	channels: [ "stdio", "syslog" ],
 };
 
+function echo_data(conn, line) {
+	printf("echo: %s\n", line);
+	conn.write(line + "\n");
+}
+
+global.memory = {
+	limit: 32 * 1024 * 1024,
+};
+
+global.profiler = {
+	path: "/tmp/ucrun.folded",
+	hz: 99,
+};
+
+global.metrics = {
+	path: "/tmp/ucrun.metrics",
+};
+
+let foo_calls = metrics_counter("ucrun_foo_calls");
+let list_time = metrics_histogram("ucrun_list_seconds", [ 0.01, 0.1, 1 ]);
+
+global.state = {
+	path: "/tmp/ucrun.state",
+};
+
 global.ubus = {
 	object: "ucrun",
 
@@ -31,11 +56,29 @@ global.ubus = {
 
 	methods: {
 		foo: {
+			cache: { ttl_ms: 1000, key: [ "name" ] },
+
 			cb: function(msg) {
+				foo_calls.inc();
 				printf("%s\n", msg);
 				printf("fooo\n");
 				return { foo: true };
 			}
+		},
+
+		list: {
+			cb: function(msg) {
+				let t = clock();
+
+				/* stream large results in batches instead of returning them */
+				for (let i = 0; i < 10000; i++)
+					ubus_reply_append("entries", { id: i, name: sprintf("entry%d", i) });
+
+				let now = clock();
+				list_time.observe((now[0] - t[0]) + (now[1] - t[1]) / 1e9);
+
+				return { count: 10000 };
+			}
 		}
 	}
 };
@@ -43,6 +86,10 @@ global.ubus = {
 global.start = function() {
 	printf("%s\n", ARGV);
 
+	let starts = state_get("starts") || 0;
+	state_set("starts", ++starts);
+	printf("started %d times\n", starts);
+
 	ulog_info("info: %08d\n", 123);
 	ulog_note("note: [%8s]\n", "abc");
 	ulog_warn("warn: %c\n", 64);
@@ -51,8 +98,25 @@ global.start = function() {
 	uloop_timeout(timeout, 1000, { private: "data" });
 	uloop_process(process, [ "sleep", "10" ], { sleep: 10 });
 	uloop_process(process, [ "echo", "abc" ], { echo: "abc" });
+
+	task(function(ctx) {
+		/* do a bit of work per call, the scheduler interleaves the slices */
+		ctx.sum += ctx.n;
+
+		return ++ctx.n < 1000000;
+	}, { n: 0, sum: 0 }, {
+		priority: -1,
+		done: function(ctx) { printf("task done: %d\n", ctx.sum); },
+	});
+
+	ustream_listen({ path: "/tmp/ucrun.sock" }, {
+		line: true,
+		accept: function(conn) { conn.write("hello\n"); },
+		data: echo_data,
+	});
 };
 
 global.stop = function() {
+	print(metrics_dump());
 	ulog_info("stopping\n");
 };
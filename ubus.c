@@ -15,10 +15,18 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <time.h>
+
 #include "ucrun.h"
 
 static struct blob_buf u;
 
+/* laid out like ucrun_cache_key_t so that it can be used for lookups */
+static struct {
+	size_t len;
+	uint8_t data[UCRUN_CACHE_KEY_MAX];
+} cache_key;
+
 ucrun_ctx_t *
 ctx_to_ucrun(struct ubus_context *ctx)
 {
@@ -28,10 +36,88 @@ ctx_to_ucrun(struct ubus_context *ctx)
 	return ucrun;
 }
 
+static uint32_t
+ubus_intern_hash(const char *str, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--)
+		hash = (hash ^ (uint8_t)*str++) * 16777619u;
+
+	return hash;
+}
+
+/*
+ * Return a shared string value for short strings, most of them are enum
+ * like values that repeat on every request. A string is only admitted on
+ * its second sighting, so one-off values like request ids or cookies stay
+ * private copies. Once the probe window is full the least used entry is
+ * replaced and the others are aged, a formerly hot entry is displaced
+ * eventually if it stops showing up.
+ */
 static uc_value_t *
-uc_blob_to_json(uc_vm_t *vm, struct blob_attr *attr, bool table, const char **name);
+ubus_intern(uc_vm_t *vm, const char *str, size_t len)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	ucrun_intern_t *e, *victim = NULL;
+	uint32_t hash, *seen, probe;
+
+	if (len > UCRUN_INTERN_MAXLEN)
+		return ucv_string_new_length(str, len);
+
+	hash = ubus_intern_hash(str, len);
+
+	for (probe = 0; probe < UCRUN_INTERN_PROBE; probe++) {
+		e = &ucrun->intern[(hash + probe) % UCRUN_INTERN_SIZE];
+
+		if (e->str && ucv_string_length(e->str) == len &&
+		    !memcmp(ucv_string_get(e->str), str, len)) {
+			if (e->hits < UINT32_MAX)
+				e->hits++;
+
+			return ucv_get(e->str);
+		}
+
+		/* prefer free slots, then the least used one */
+		if (!victim || (victim->str && (!e->str || e->hits < victim->hits)))
+			victim = e;
+	}
+
+	seen = &ucrun->intern_seen[hash % UCRUN_INTERN_SIZE];
+
+	if (*seen != hash) {
+		*seen = hash;
+
+		return ucv_string_new_length(str, len);
+	}
+
+	for (probe = 0; probe < UCRUN_INTERN_PROBE; probe++)
+		ucrun->intern[(hash + probe) % UCRUN_INTERN_SIZE].hits /= 2;
+
+	ucv_put(victim->str);
+	victim->str = ucv_string_new_length(str, len);
+	victim->hits = 1;
+
+	return ucv_get(victim->str);
+}
+
+void
+ubus_intern_free(ucrun_ctx_t *ucrun)
+{
+	size_t i;
+
+	for (i = 0; i < UCRUN_INTERN_SIZE; i++) {
+		ucv_put(ucrun->intern[i].str);
+		ucrun->intern[i].str = NULL;
+		ucrun->intern[i].hits = 0;
+		ucrun->intern_seen[i] = 0;
+	}
+}
 
 static uc_value_t *
+uc_blob_to_json(uc_vm_t *vm, struct blob_attr *attr, bool table, const char **name);
+
+uc_value_t *
 uc_blob_array_to_json(uc_vm_t *vm, struct blob_attr *attr, size_t len, bool table)
 {
 	uc_value_t *o = table ? ucv_object_new(vm) : ucv_array_new(vm);
@@ -98,7 +184,8 @@ uc_blob_to_json(uc_vm_t *vm, struct blob_attr *attr, bool table, const char **na
 		return ucv_double_new(v.d);
 
 	case BLOBMSG_TYPE_STRING:
-		return ucv_string_new(data);
+		/* the data length includes the terminating zero byte */
+		return ubus_intern(vm, data, len ? len - 1 : 0);
 
 	case BLOBMSG_TYPE_ARRAY:
 		return uc_blob_array_to_json(vm, data, len, false);
@@ -111,6 +198,427 @@ uc_blob_to_json(uc_vm_t *vm, struct blob_attr *attr, bool table, const char **na
 	}
 }
 
+static void
+uc_value_to_blob(uc_vm_t *vm, struct blob_buf *b, const char *name, uc_value_t *val, int depth)
+{
+	int64_t n;
+	char *str;
+	void *c;
+	size_t i;
+
+	/* recursive structures cannot be represented, cut them off */
+	if (depth > UCRUN_REPLY_MAX_DEPTH)
+		val = NULL;
+
+	switch (ucv_type(val)) {
+	case UC_NULL:
+		blobmsg_add_field(b, BLOBMSG_TYPE_UNSPEC, name, NULL, 0);
+		break;
+
+	case UC_BOOLEAN:
+		blobmsg_add_u8(b, name, ucv_boolean_get(val));
+		break;
+
+	case UC_INTEGER:
+		n = ucv_int64_get(val);
+
+		/* same width selection as blobmsg_add_json_element() */
+		if (n >= INT32_MIN && n <= INT32_MAX)
+			blobmsg_add_u32(b, name, n);
+		else
+			blobmsg_add_u64(b, name, n);
+		break;
+
+	case UC_DOUBLE:
+		blobmsg_add_double(b, name, ucv_double_get(val));
+		break;
+
+	case UC_STRING:
+		blobmsg_add_field(b, BLOBMSG_TYPE_STRING, name,
+				  ucv_string_get(val), ucv_string_length(val) + 1);
+		break;
+
+	case UC_ARRAY:
+		c = blobmsg_open_array(b, name);
+
+		for (i = 0; i < ucv_array_length(val); i++)
+			uc_value_to_blob(vm, b, NULL, ucv_array_get(val, i), depth + 1);
+
+		blobmsg_close_array(b, c);
+		break;
+
+	case UC_OBJECT:
+		c = blobmsg_open_table(b, name);
+
+		ucv_object_foreach(val, k, v)
+			uc_value_to_blob(vm, b, k, v, depth + 1);
+
+		blobmsg_close_table(b, c);
+		break;
+
+	default:
+		str = ucv_to_string(vm, val);
+		blobmsg_add_string(b, name, str);
+		free(str);
+		break;
+	}
+}
+
+static void
+ubus_reply_flush(ucrun_ctx_t *ucrun)
+{
+	/* terminate the batch array that is currently being filled */
+	if (ucrun->ubus_reply_cookie) {
+		blobmsg_close_array(&u, ucrun->ubus_reply_cookie);
+		ucrun->ubus_reply_cookie = NULL;
+	}
+
+	ucv_put(ucrun->ubus_reply_key);
+	ucrun->ubus_reply_key = NULL;
+
+	if (!ucrun->ubus_reply_pending)
+		return;
+
+	ubus_send_reply(&ucrun->ubus_auto_conn.ctx, ucrun->ubus_req, u.head);
+	ucrun->ubus_reply_pending = false;
+	ucrun->ubus_reply_streamed = true;
+}
+
+static bool
+ubus_reply_object(ucrun_ctx_t *ucrun, uc_value_t *obj)
+{
+	blob_buf_init(&u, 0);
+
+	ucv_object_foreach(obj, k, v)
+		uc_value_to_blob(&ucrun->vm, &u, k, v, 0);
+
+	/* check if we need to send a reply */
+	if (!blobmsg_len(u.head))
+		return false;
+
+	ubus_send_reply(&ucrun->ubus_auto_conn.ctx, ucrun->ubus_req, u.head);
+
+	return true;
+}
+
+static uc_value_t *
+uc_ubus_reply(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	uc_value_t *data = uc_fn_arg(0);
+
+	/* replies can only be sent from within a method handler */
+	if (!ucrun->ubus_req || ucv_type(data) != UC_OBJECT)
+		return ucv_int64_new(-1);
+
+	/* keep the message order, anything batched so far goes out first */
+	ubus_reply_flush(ucrun);
+
+	if (ubus_reply_object(ucrun, data))
+		ucrun->ubus_reply_streamed = true;
+
+	return ucv_int64_new(0);
+}
+
+static uc_value_t *
+uc_ubus_reply_append(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	uc_value_t *key = uc_fn_arg(0);
+	uc_value_t *data = uc_fn_arg(1);
+
+	/* replies can only be sent from within a method handler */
+	if (!ucrun->ubus_req || ucv_type(key) != UC_STRING)
+		return ucv_int64_new(-1);
+
+	if (!memory_guard(vm))
+		return NULL;
+
+	/* items of a different key go into a new array of the same message */
+	if (ucrun->ubus_reply_cookie &&
+	    strcmp(ucv_string_get(ucrun->ubus_reply_key), ucv_string_get(key))) {
+		blobmsg_close_array(&u, ucrun->ubus_reply_cookie);
+		ucrun->ubus_reply_cookie = NULL;
+		ucv_put(ucrun->ubus_reply_key);
+		ucrun->ubus_reply_key = NULL;
+	}
+
+	if (!ucrun->ubus_reply_cookie) {
+		if (!ucrun->ubus_reply_pending)
+			blob_buf_init(&u, 0);
+
+		ucrun->ubus_reply_cookie = blobmsg_open_array(&u, ucv_string_get(key));
+		ucrun->ubus_reply_key = ucv_get(key);
+		ucrun->ubus_reply_pending = true;
+	}
+
+	uc_value_to_blob(vm, &u, NULL, data, 0);
+
+	/* send the batch once it reached the chunk size, the buffer is reused */
+	if (blob_len(u.head) >= UCRUN_REPLY_CHUNK)
+		ubus_reply_flush(ucrun);
+
+	return ucv_int64_new(0);
+}
+
+static uint64_t
+ubus_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+ubus_cache_cmp(const void *k1, const void *k2, void *ptr)
+{
+	const ucrun_cache_key_t *a = k1, *b = k2;
+
+	if (a->len != b->len)
+		return (a->len < b->len) ? -1 : 1;
+
+	return memcmp(a->data, b->data, a->len);
+}
+
+static ucrun_cache_t *
+ubus_cache_find(ucrun_ctx_t *ucrun, const char *name)
+{
+	int i;
+
+	if (!ucrun->ubus_cache)
+		return NULL;
+
+	for (i = 0; i < ucrun->ubus_object_type.n_methods; i++)
+		if (ucrun->ubus_method[i].name && !strcmp(ucrun->ubus_method[i].name, name))
+			return ucrun->ubus_cache[i];
+
+	return NULL;
+}
+
+static bool
+ubus_cache_key_add(const void *data, size_t len)
+{
+	if (cache_key.len + len > sizeof(cache_key.data))
+		return false;
+
+	memcpy(cache_key.data + cache_key.len, data, len);
+	cache_key.len += len;
+
+	return true;
+}
+
+/*
+ * The cache key is made of the raw blob attributes of the declared
+ * arguments, an argument that was not passed is recorded as a zero word.
+ * A missing message counts as all arguments missing.
+ */
+static bool
+ubus_cache_key(ucrun_cache_t *cache, struct blob_attr *msg)
+{
+	static const uint32_t missing = 0;
+	struct blob_attr *cur, *found;
+	uc_value_t *arg;
+	size_t i, rem;
+
+	cache_key.len = 0;
+
+	for (i = 0; i < ucv_array_length(cache->args); i++) {
+		arg = ucv_array_get(cache->args, i);
+		found = NULL;
+
+		if (ucv_type(arg) != UC_STRING)
+			continue;
+
+		/* libubus passes no message at all if the caller sent no data */
+		if (msg) {
+			blob_for_each_attr(cur, msg, rem) {
+				/* only the outer message was validated, like uc_blob_to_json() skip bad ones */
+				if (!blobmsg_check_attr(cur, true))
+					continue;
+
+				if (!strcmp(blobmsg_name(cur), ucv_string_get(arg))) {
+					found = cur;
+					break;
+				}
+			}
+		}
+
+		if (found ? !ubus_cache_key_add(found, blob_raw_len(found))
+			  : !ubus_cache_key_add(&missing, sizeof(missing)))
+			return false;
+	}
+
+	return true;
+}
+
+static void
+ubus_cache_entry_free(ucrun_cache_t *cache, ucrun_cache_entry_t *entry)
+{
+	avl_delete(&cache->entries, &entry->avl);
+	free(entry->reply);
+	free(entry);
+}
+
+static void
+ubus_cache_flush(ucrun_cache_t *cache)
+{
+	ucrun_cache_entry_t *entry, *e;
+
+	avl_for_each_element_safe(&cache->entries, entry, avl, e)
+		ubus_cache_entry_free(cache, entry);
+}
+
+static void
+ubus_cache_store(ucrun_cache_t *cache, struct blob_attr *reply)
+{
+	ucrun_cache_entry_t *entry, *e, *oldest = NULL;
+	uint64_t now = ubus_cache_now();
+
+	/* make room, expired entries go first and the one expiring next after that */
+	if (cache->entries.count >= UCRUN_CACHE_ENTRIES)
+		avl_for_each_element_safe(&cache->entries, entry, avl, e)
+			if (entry->expires <= now)
+				ubus_cache_entry_free(cache, entry);
+
+	if (cache->entries.count >= UCRUN_CACHE_ENTRIES) {
+		/* all entries of a method share the ttl, so this is the oldest one */
+		avl_for_each_element(&cache->entries, entry, avl)
+			if (!oldest || entry->expires < oldest->expires)
+				oldest = entry;
+
+		ubus_cache_entry_free(cache, oldest);
+	}
+
+	entry = calloc(1, sizeof(*entry) + sizeof(*entry->key) + cache_key.len);
+	if (!entry)
+		return;
+
+	entry->key = (ucrun_cache_key_t *)(entry + 1);
+	entry->key->len = cache_key.len;
+	memcpy(entry->key->data, cache_key.data, cache_key.len);
+	entry->reply = reply ? blob_memdup(reply) : NULL;
+	entry->expires = now + cache->ttl;
+	entry->avl.key = entry->key;
+	avl_insert(&cache->entries, &entry->avl);
+}
+
+static bool
+ubus_cache_reply(ucrun_cache_t *cache, struct ubus_context *ctx,
+		 struct ubus_request_data *req)
+{
+	ucrun_cache_entry_t *entry;
+
+	entry = avl_find_element(&cache->entries, &cache_key, entry, avl);
+
+	if (entry && entry->expires <= ubus_cache_now()) {
+		ubus_cache_entry_free(cache, entry);
+		entry = NULL;
+	}
+
+	if (!entry) {
+		cache->misses++;
+
+		return false;
+	}
+
+	cache->hits++;
+
+	if (entry->reply)
+		ubus_send_reply(ctx, req, entry->reply);
+
+	return true;
+}
+
+static uc_value_t *
+uc_ubus_cache_invalidate(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	uc_value_t *name = uc_fn_arg(0);
+	ucrun_cache_t *cache;
+	int i;
+
+	if (!ucrun->ubus_cache)
+		return ucv_int64_new(-1);
+
+	/* without a method name all caches are dropped */
+	if (ucv_type(name) == UC_STRING) {
+		cache = ubus_cache_find(ucrun, ucv_string_get(name));
+		if (!cache)
+			return ucv_int64_new(-1);
+
+		ubus_cache_flush(cache);
+
+		return ucv_int64_new(0);
+	}
+
+	for (i = 0; i < ucrun->ubus_object_type.n_methods; i++)
+		if (ucrun->ubus_cache[i])
+			ubus_cache_flush(ucrun->ubus_cache[i]);
+
+	return ucv_int64_new(0);
+}
+
+static uc_value_t *
+uc_ubus_cache_stats(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_ctx_t *ucrun = vm_to_ucrun(vm);
+	uc_value_t *stats = ucv_object_new(vm), *stat;
+	ucrun_cache_t *cache;
+	int i;
+
+	for (i = 0; ucrun->ubus_cache && i < ucrun->ubus_object_type.n_methods; i++) {
+		cache = ucrun->ubus_cache[i];
+		if (!cache)
+			continue;
+
+		stat = ucv_object_new(vm);
+		ucv_object_add(stat, "hits", ucv_uint64_new(cache->hits));
+		ucv_object_add(stat, "misses", ucv_uint64_new(cache->misses));
+		ucv_object_add(stat, "entries", ucv_int64_new(cache->entries.count));
+		ucv_object_add(stats, ucrun->ubus_method[i].name, stat);
+	}
+
+	return stats;
+}
+
+static ucrun_cache_t *
+ubus_cache_new(uc_value_t *decl)
+{
+	uc_value_t *ttl = ucv_object_get(decl, "ttl_ms", NULL);
+	uc_value_t *args = ucv_object_get(decl, "key", NULL);
+	ucrun_cache_t *cache;
+
+	/* make sure the declaration is complete */
+	if (ucv_type(ttl) != UC_INTEGER || ucv_int64_get(ttl) <= 0 ||
+	    (args && ucv_type(args) != UC_ARRAY)) {
+		fprintf(stderr, "The ubus cache declaration is invalid - ignoring\n");
+		return NULL;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	avl_init(&cache->entries, ubus_cache_cmp, false, NULL);
+	cache->ttl = ucv_int64_get(ttl);
+	cache->args = ucv_get(args);
+
+	return cache;
+}
+
+static void
+ubus_cache_free(ucrun_cache_t *cache)
+{
+	if (!cache)
+		return;
+
+	ubus_cache_flush(cache);
+	ucv_put(cache->args);
+	free(cache);
+}
+
 static int
 ubus_ucode_cb(struct ubus_context *ctx,
 	      struct ubus_object *obj,
@@ -119,11 +627,24 @@ ubus_ucode_cb(struct ubus_context *ctx,
 	      struct blob_attr *msg)
 {
 	ucrun_ctx_t *ucrun = ctx_to_ucrun(ctx);
+	ucrun_cache_t *cache = ubus_cache_find(ucrun, name);
+	bool replied = false;
 
 	/* try to find the method */
 	uc_value_t *methods = ucv_object_get(ucrun->ubus, "methods", NULL);
 	uc_value_t *method = NULL, *cb, *retval = NULL;
 
+	/* serve repeated calls straight from the encoded reply cache */
+	if (cache && !ubus_cache_key(cache, msg))
+		cache = NULL;
+
+	if (cache && ubus_cache_reply(cache, ctx, req))
+		return UBUS_STATUS_OK;
+
+	/* refuse to enter the VM while it is over its memory budget */
+	if (!memory_check(ucrun))
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
 	ucv_object_foreach(methods, key, val) {
 		if (strcmp(key, name))
 			continue;
@@ -145,23 +666,32 @@ ubus_ucode_cb(struct ubus_context *ctx,
 		uc_vm_stack_push(&ucrun->vm,
 				 uc_blob_array_to_json(&ucrun->vm, blob_data(msg), blob_len(msg), true));
 
-	/* execute the callback */
+	/*
+	 * Allow the callback to stream its reply while it runs. Handlers run
+	 * synchronously and ucrun issues no calls on its own connection, so
+	 * requests never nest and a single set of reply state suffices.
+	 */
+	ucrun->ubus_req = req;
+	ucrun->ubus_reply_streamed = false;
+
+	/* execute the callback, failed calls are never cached */
 	if (!uc_vm_call(&ucrun->vm, false, msg ? 1 : 0))
 		retval = uc_vm_stack_pop(&ucrun->vm);
+	else
+		cache = NULL;
 
-	if (ucv_type(retval) == UC_OBJECT) {
-		json_object *o;
+	/* send out whatever is left of a streamed reply */
+	ubus_reply_flush(ucrun);
 
-		blob_buf_init(&u, 0);
-		o = ucv_to_json(retval);
-		blobmsg_add_object(&u, o);
-		json_object_put(o);
+	/* the return value goes out last, converted straight into the blob */
+	if (ucv_type(retval) == UC_OBJECT)
+		replied = ubus_reply_object(ucrun, retval);
 
-		/* check if we need to send a reply */
-		if (blobmsg_len(u.head))
-			ubus_send_reply(ctx, req, u.head);
-	}
+	/* the key built for the lookup is still in place */
+	if (cache && !ucrun->ubus_reply_streamed)
+		ubus_cache_store(cache, replied ? u.head : NULL);
 
+	ucrun->ubus_req = NULL;
 	ucv_put(retval);
 
 	return UBUS_STATUS_OK;
@@ -191,6 +721,15 @@ ubus_connect_handler(struct ubus_context *ctx)
 	ucv_put(retval);
 }
 
+void
+ubus_register(ucrun_ctx_t *ucrun)
+{
+	uc_function_register(ucrun->scope, "ubus_reply", uc_ubus_reply);
+	uc_function_register(ucrun->scope, "ubus_reply_append", uc_ubus_reply_append);
+	uc_function_register(ucrun->scope, "ubus_cache_invalidate", uc_ubus_cache_invalidate);
+	uc_function_register(ucrun->scope, "ubus_cache_stats", uc_ubus_cache_stats);
+}
+
 void
 ubus_init(ucrun_ctx_t *ucrun)
 {
@@ -210,13 +749,22 @@ ubus_init(ucrun_ctx_t *ucrun)
 	/* create our ubus methods */
 	n_methods = ucv_object_length(methods);
 	ucrun->ubus_method = calloc(n_methods, sizeof(struct ubus_method));
+	ucrun->ubus_cache = calloc(n_methods, sizeof(ucrun_cache_t *));
 
 	ucv_object_foreach(methods, key, val) {
+		uc_value_t *cache;
+
 		if (!ucv_object_get(val, "cb", NULL))
 			continue;
 
 		ucrun->ubus_method[n].name = key;
 		ucrun->ubus_method[n].handler = ubus_ucode_cb;
+
+		/* read-mostly methods may ask for their replies to be cached */
+		cache = ucv_object_get(val, "cache", NULL);
+		if (cache)
+			ucrun->ubus_cache[n] = ubus_cache_new(cache);
+
 		n++;
 	}
 
@@ -240,6 +788,8 @@ ubus_init(ucrun_ctx_t *ucrun)
 void
 ubus_deinit(ucrun_ctx_t *ucrun)
 {
+	int i;
+
 	if (!ucrun->ubus)
 		return;
 
@@ -248,5 +798,10 @@ ubus_deinit(ucrun_ctx_t *ucrun)
 
 	blob_buf_free(&u);
 	free(ucrun->ubus_name);
+
+	for (i = 0; i < ucrun->ubus_object_type.n_methods; i++)
+		ubus_cache_free(ucrun->ubus_cache[i]);
+
+	free(ucrun->ubus_cache);
 	free(ucrun->ubus_method);
 }
@@ -21,6 +21,8 @@ static uc_parse_config_t config = {
 	.strict_declarations = true,
 	.raw_mode = true,
 	.lstrip_blocks = true,
+	/* the profiler samples through the VM signal dispatch */
+	.setup_signal_handlers = true,
 };
 
 static const char *exception_types[] = {
@@ -172,6 +174,9 @@ uc_uloop_timeout(uc_vm_t *vm, size_t nargs)
 	if (!ucv_is_callable(function) || ucv_type(expire) != UC_INTEGER)
 		return ucv_int64_new(-1);
 
+	if (!memory_guard(vm))
+		return NULL;
+
 	/* add the uloop timer */
 	timeout = calloc(1, sizeof(*timeout));
 	timeout->function = ucv_get(function);
@@ -227,6 +232,9 @@ uc_uloop_process(uc_vm_t *vm, size_t nargs)
 	if (!ucv_is_callable(function) || ucv_type(command) != UC_ARRAY)
 		return ucv_int64_new(-1);
 
+	if (!memory_guard(vm))
+		return NULL;
+
 	/* fork of the child */
 	pid = fork();
 	if (pid < 0)
@@ -270,6 +278,88 @@ uc_uloop_process(uc_vm_t *vm, size_t nargs)
 	return ucv_int64_new(0);
 }
 
+static void
+uc_uloop_fd_free(ucrun_fd_t *fd)
+{
+	uloop_fd_delete(&fd->fd);
+	ucv_put(fd->function);
+	ucv_put(fd->priv);
+	list_del(&fd->list);
+	free(fd);
+}
+
+static void
+uc_uloop_fd_cb(struct uloop_fd *u, unsigned int events)
+{
+	ucrun_fd_t *fd = container_of(u, ucrun_fd_t, fd);
+	uc_value_t *retval = NULL;
+
+	/* push the function, the events and private data to the stack */
+	uc_vm_stack_push(&fd->ucrun->vm, ucv_get(fd->function));
+	uc_vm_stack_push(&fd->ucrun->vm, ucv_int64_new(events));
+	uc_vm_stack_push(&fd->ucrun->vm, ucv_get(fd->priv));
+
+	/* invoke function */
+	if (uc_vm_call(&fd->ucrun->vm, false, 2)) {
+		/* function raised an exception, bail out */
+		goto out;
+	}
+
+	retval = uc_vm_stack_pop(&fd->ucrun->vm);
+
+	/* keep watching unless the callback returned false or the fd is dead */
+	if ((ucv_type(retval) != UC_BOOLEAN || ucv_boolean_get(retval)) &&
+	    !u->eof && !u->error) {
+		ucv_put(retval);
+		return;
+	}
+
+out:
+	/* free the watcher context, the fd itself belongs to the user code */
+	uc_uloop_fd_free(fd);
+	ucv_put(retval);
+}
+
+static uc_value_t *
+uc_uloop_fd(uc_vm_t *vm, size_t nargs)
+{
+	ucrun_fd_t *fd;
+
+	uc_value_t *function = uc_fn_arg(0);
+	uc_value_t *handle = uc_fn_arg(1);
+	uc_value_t *priv = uc_fn_arg(2);
+	uc_value_t *flags = uc_fn_arg(3);
+
+	/* check if the call signature is correct */
+	if (!ucv_is_callable(function) || ucv_type(handle) != UC_INTEGER ||
+	    (flags && ucv_type(flags) != UC_INTEGER))
+		return ucv_int64_new(-1);
+
+	if (!memory_guard(vm))
+		return NULL;
+
+	/* add the uloop fd */
+	fd = calloc(1, sizeof(*fd));
+	fd->function = ucv_get(function);
+	fd->fd.cb = uc_uloop_fd_cb;
+	fd->fd.fd = ucv_int64_get(handle);
+	fd->ucrun = vm_to_ucrun(vm);
+	fd->priv = ucv_get(priv);
+
+	if (uloop_fd_add(&fd->fd, flags ? ucv_int64_get(flags) : ULOOP_READ)) {
+		ucv_put(fd->function);
+		ucv_put(fd->priv);
+		free(fd);
+
+		return ucv_int64_new(-1);
+	}
+
+	/* track the fd in our context */
+	list_add(&fd->list, &vm_to_ucrun(vm)->fd);
+
+	return ucv_int64_new(0);
+}
+
 static void
 ucode_init_ubus(ucrun_ctx_t *ucrun)
 {
@@ -282,6 +372,79 @@ ucode_init_ubus(ucrun_ctx_t *ucrun)
 	ubus_init(ucrun);
 }
 
+static void
+ucode_init_memory(ucrun_ctx_t *ucrun)
+{
+	uc_value_t *memory = ucv_object_get(ucrun->scope, "memory", NULL);
+	uc_value_t *limit;
+
+	/* make sure the declaration is complete */
+	if (ucv_type(memory) != UC_OBJECT)
+		return;
+
+	limit = ucv_object_get(memory, "limit", NULL);
+
+	if (ucv_type(limit) != UC_INTEGER || ucv_int64_get(limit) <= 0)
+		return;
+
+	memory_init(ucrun, ucv_int64_get(limit));
+}
+
+static void
+ucode_init_profiler(ucrun_ctx_t *ucrun)
+{
+	uc_value_t *profiler = ucv_object_get(ucrun->scope, "profiler", NULL);
+	uc_value_t *path, *hz;
+
+	/* make sure the declaration is complete */
+	if (ucv_type(profiler) != UC_OBJECT)
+		return;
+
+	path = ucv_object_get(profiler, "path", NULL);
+	hz = ucv_object_get(profiler, "hz", NULL);
+
+	if (ucv_type(path) != UC_STRING || (hz && ucv_type(hz) != UC_INTEGER))
+		return;
+
+	profiler_init(ucrun, ucv_string_get(path), hz ? ucv_int64_get(hz) : 0);
+}
+
+static void
+ucode_init_metrics(ucrun_ctx_t *ucrun)
+{
+	uc_value_t *metrics = ucv_object_get(ucrun->scope, "metrics", NULL);
+	uc_value_t *path;
+
+	/* make sure the declaration is complete */
+	if (ucv_type(metrics) != UC_OBJECT)
+		return;
+
+	path = ucv_object_get(metrics, "path", NULL);
+
+	if (ucv_type(path) != UC_STRING)
+		return;
+
+	metrics_init(ucrun, ucv_string_get(path));
+}
+
+static void
+ucode_init_state(ucrun_ctx_t *ucrun)
+{
+	uc_value_t *state = ucv_object_get(ucrun->scope, "state", NULL);
+	uc_value_t *path;
+
+	/* make sure the declaration is complete */
+	if (ucv_type(state) != UC_OBJECT)
+		return;
+
+	path = ucv_object_get(state, "path", NULL);
+
+	if (ucv_type(path) != UC_STRING)
+		return;
+
+	state_init(ucrun, ucv_string_get(path));
+}
+
 static uc_cfn_ptr_t fmtfn;
 
 static uc_value_t *
@@ -381,6 +544,10 @@ ucode_init(ucrun_ctx_t *ucrun, int argc, const char **argv, int *rc)
 	/* setup the ucrun context */
 	INIT_LIST_HEAD(&ucrun->timeout);
 	INIT_LIST_HEAD(&ucrun->process);
+	INIT_LIST_HEAD(&ucrun->fd);
+	INIT_LIST_HEAD(&ucrun->stream);
+	INIT_LIST_HEAD(&ucrun->server);
+	INIT_LIST_HEAD(&ucrun->task);
 
 	/* initialize VM context */
 	uc_search_path_init(&config.module_search_path);
@@ -402,10 +569,20 @@ ucode_init(ucrun_ctx_t *ucrun, int argc, const char **argv, int *rc)
 	/* load native functions into the vm */
 	uc_function_register(ucrun->scope, "uloop_timeout", uc_uloop_timeout);
 	uc_function_register(ucrun->scope, "uloop_process", uc_uloop_process);
+	uc_function_register(ucrun->scope, "uloop_fd", uc_uloop_fd);
+	ucv_object_add(ucrun->scope, "ULOOP_READ", ucv_int64_new(ULOOP_READ));
+	ucv_object_add(ucrun->scope, "ULOOP_WRITE", ucv_int64_new(ULOOP_WRITE));
 	uc_function_register(ucrun->scope, "ulog_info", uc_ulog_info);
 	uc_function_register(ucrun->scope, "ulog_note", uc_ulog_note);
 	uc_function_register(ucrun->scope, "ulog_warn", uc_ulog_warn);
 	uc_function_register(ucrun->scope, "ulog_err", uc_ulog_err);
+	memory_register(ucrun);
+	ubus_register(ucrun);
+	state_register(ucrun);
+	stream_register(ucrun);
+	task_register(ucrun);
+	profiler_register(ucrun);
+	metrics_register(ucrun);
 
 	/* add commandline parameters */
 	ARGV = ucv_array_new(&ucrun->vm);
@@ -422,6 +599,18 @@ ucode_init(ucrun_ctx_t *ucrun, int argc, const char **argv, int *rc)
 	/* enable ulog if requested */
 	ucode_init_ulog(ucrun);
 
+	/* apply the memory budget if requested */
+	ucode_init_memory(ucrun);
+
+	/* allow toggling the profiler by signal if requested */
+	ucode_init_profiler(ucrun);
+
+	/* export the metrics segment if requested */
+	ucode_init_metrics(ucrun);
+
+	/* open the persistent state store so that start() can resume from it */
+	ucode_init_state(ucrun);
+
 	/* everything is now setup, start the user code */
 	start = ucv_object_get(ucrun->scope, "start", NULL);
 
@@ -460,6 +649,7 @@ ucode_deinit(ucrun_ctx_t *ucrun)
 {
 	ucrun_timeout_t *timeout, *t;
 	ucrun_process_t *process, *p;
+	ucrun_fd_t *fd, *f;
 	uc_exception_type_t ex;
 	uc_value_t *stop;
 
@@ -493,6 +683,19 @@ ucode_deinit(ucrun_ctx_t *ucrun)
 	list_for_each_entry_safe(process, p, &ucrun->process, list)
 		uc_uloop_process_free(process);
 
+	/* stop the profiler and restore the native functions */
+	profiler_deinit(ucrun);
+
+	/* drop all unfinished tasks */
+	task_deinit(ucrun);
+
+	/* stop watching file descriptors */
+	list_for_each_entry_safe(fd, f, &ucrun->fd, list)
+		uc_uloop_fd_free(fd);
+
+	/* close all stream servers and connections */
+	stream_deinit(ucrun);
+
 	/* free ulog */
 	if (ucrun->ulog_identity)
 		free(ucrun->ulog_identity);
@@ -500,6 +703,15 @@ ucode_deinit(ucrun_ctx_t *ucrun)
 	/* disconnect from ubus */
 	ubus_deinit(ucrun);
 
+	/* flush and close the state store */
+	state_deinit(ucrun);
+
+	/* remove the exported metrics segment */
+	metrics_deinit(ucrun);
+
+	/* release the interned strings */
+	ubus_intern_free(ucrun);
+
 	/* free program */
 	uc_program_put(ucrun->prog);
 
@@ -20,13 +20,91 @@
 #include <ucode/vm.h>
 
 #include <libubus.h>
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
 #include <libubox/blobmsg_json.h>
 #include <libubox/uloop.h>
 #include <libubox/ulog.h>
+#include <libubox/ustream.h>
+
+#include "metrics.h"
+
+typedef struct {
+	struct avl_tree index;
+	struct uloop_timeout compact;
+
+	char *path;
+	int fd;
+	uint8_t *map;
+	size_t size;
+	size_t used;
+	size_t live;
+} ucrun_state_t;
+
+#define UCRUN_INTERN_SIZE	256
+#define UCRUN_INTERN_PROBE	8
+#define UCRUN_INTERN_MAXLEN	32
+
+typedef struct {
+	uc_value_t *str;
+	uint32_t hits;
+} ucrun_intern_t;
+
+/* longest line a line mode stream accepts before dropping the connection */
+#define UCRUN_STREAM_LINE_MAX	(64 * 1024)
+
+#define UCRUN_REPLY_CHUNK	(32 * 1024)
+#define UCRUN_REPLY_MAX_DEPTH	32
+
+#define UCRUN_CACHE_KEY_MAX	512
+#define UCRUN_CACHE_ENTRIES	64
+
+#define UCRUN_ALLOC_CLASSES	14
+
+typedef struct {
+	size_t size;
+	size_t used;
+	size_t peak;
+	size_t slabs;
+} ucrun_alloc_class_t;
+
+typedef struct {
+	size_t usage;
+	size_t peak;
+	size_t mapped;
+	size_t limit;
+	size_t large;
+	size_t large_bytes;
+	ucrun_alloc_class_t classes[UCRUN_ALLOC_CLASSES];
+} ucrun_alloc_stats_t;
+
+typedef struct {
+	size_t len;
+	uint8_t data[];
+} ucrun_cache_key_t;
+
+typedef struct {
+	struct avl_node avl;
+	ucrun_cache_key_t *key;
+	struct blob_attr *reply;
+	uint64_t expires;
+} ucrun_cache_entry_t;
+
+typedef struct {
+	struct avl_tree entries;
+	uc_value_t *args;
+	int64_t ttl;
+	uint64_t hits;
+	uint64_t misses;
+} ucrun_cache_t;
 
 typedef struct {
 	struct list_head timeout;
 	struct list_head process;
+	struct list_head fd;
+	struct list_head stream;
+	struct list_head server;
+	struct list_head task;
 
 	uc_vm_t vm;
 	uc_value_t *scope;
@@ -34,12 +112,45 @@ typedef struct {
 
 	char *ulog_identity;
 
+	ucrun_intern_t intern[UCRUN_INTERN_SIZE];
+	uint32_t intern_seen[UCRUN_INTERN_SIZE];
+
+	ucrun_state_t state;
+
+	size_t mem_limit;
+	uint64_t mem_gc;
+	bool mem_over;
+
+	struct avl_tree profiler_stacks;
+	struct uloop_fd profiler_fd;
+	struct uloop_fd profiler_sig;
+	char *profiler_path;
+	int profiler_hz;
+	bool profiler_running;
+	uint64_t profiler_dropped;
+
+	struct ucrun_metrics *metrics;
+	struct uloop_timeout metrics_timeout;
+	char *metrics_path;
+
+	struct uloop_timeout task_timeout;
+	struct ucrun_task *task_running;
+	int64_t task_id;
+	uint64_t task_slices;
+	uint64_t task_time;
+
 	uc_value_t *ubus;
 	char *ubus_name;
 	struct ubus_method *ubus_method;
+	ucrun_cache_t **ubus_cache;
 	struct ubus_object_type ubus_object_type;
 	struct ubus_object ubus_object;
 	struct ubus_auto_conn ubus_auto_conn;
+	struct ubus_request_data *ubus_req;
+	uc_value_t *ubus_reply_key;
+	void *ubus_reply_cookie;
+	bool ubus_reply_pending;
+	bool ubus_reply_streamed;
 } ucrun_ctx_t;
 
 typedef struct {
@@ -60,6 +171,57 @@ typedef struct {
 	uc_value_t *priv;
 } ucrun_process_t;
 
+typedef struct {
+	struct list_head list;
+	ucrun_ctx_t *ucrun;
+
+	struct uloop_fd fd;
+	uc_value_t *function;
+	uc_value_t *priv;
+} ucrun_fd_t;
+
+typedef struct {
+	struct list_head list;
+	ucrun_ctx_t *ucrun;
+
+	struct ustream_fd stream;
+	struct uloop_timeout free;
+	uc_value_t *res;
+	uc_value_t *handlers;
+	char *linebuf;
+	size_t linelen;
+	bool line;
+	bool closed;
+} ucrun_stream_t;
+
+typedef struct {
+	struct list_head list;
+	ucrun_ctx_t *ucrun;
+
+	struct uloop_fd fd;
+	struct uloop_timeout free;
+	uc_value_t *res;
+	uc_value_t *handlers;
+	bool closed;
+} ucrun_server_t;
+
+typedef struct ucrun_task {
+	struct list_head list;
+	ucrun_ctx_t *ucrun;
+
+	uc_value_t *function;
+	uc_value_t *priv;
+	uc_value_t *done;
+	int64_t id;
+	int priority;
+	uint64_t slice;
+	bool cancelled;
+
+	uint64_t slices;
+	uint64_t calls;
+	uint64_t time;
+} ucrun_task_t;
+
 static inline ucrun_ctx_t *
 vm_to_ucrun(uc_vm_t *vm)
 {
@@ -69,5 +231,37 @@ vm_to_ucrun(uc_vm_t *vm)
 extern bool ucode_init(ucrun_ctx_t *ucrun, int argc, const char **argv, int *rc);
 extern void ucode_deinit(ucrun_ctx_t *ucrun);
 
+extern void ubus_register(ucrun_ctx_t *ucrun);
 extern void ubus_init(ucrun_ctx_t *ucrun);
 extern void ubus_deinit(ucrun_ctx_t *ucrun);
+extern void ubus_intern_free(ucrun_ctx_t *ucrun);
+extern uc_value_t *uc_blob_array_to_json(uc_vm_t *vm, struct blob_attr *attr, size_t len, bool table);
+
+extern void stream_register(ucrun_ctx_t *ucrun);
+extern void stream_deinit(ucrun_ctx_t *ucrun);
+
+extern size_t alloc_usage(void);
+extern void alloc_limit(size_t limit);
+extern void alloc_trim(void);
+extern void alloc_stats(ucrun_alloc_stats_t *stats);
+
+extern void memory_register(ucrun_ctx_t *ucrun);
+extern void memory_init(ucrun_ctx_t *ucrun, size_t limit);
+extern size_t memory_usage(void);
+extern bool memory_check(ucrun_ctx_t *ucrun);
+extern bool memory_guard(uc_vm_t *vm);
+
+extern void profiler_register(ucrun_ctx_t *ucrun);
+extern void profiler_init(ucrun_ctx_t *ucrun, const char *path, int hz);
+extern void profiler_deinit(ucrun_ctx_t *ucrun);
+
+extern void metrics_register(ucrun_ctx_t *ucrun);
+extern void metrics_init(ucrun_ctx_t *ucrun, const char *path);
+extern void metrics_deinit(ucrun_ctx_t *ucrun);
+
+extern void task_register(ucrun_ctx_t *ucrun);
+extern void task_deinit(ucrun_ctx_t *ucrun);
+
+extern void state_register(ucrun_ctx_t *ucrun);
+extern void state_init(ucrun_ctx_t *ucrun, const char *path);
+extern void state_deinit(ucrun_ctx_t *ucrun);